@@ -0,0 +1,358 @@
+<?hh //decl
+
+// Throughput benchmarks for the Jack parser, the Jack compiler and the VM translator
+
+include('JackGenerator.hh');
+
+/*
+	Generates a corpus of synthetic Jack classes in a temporary directory and
+	times Part_4/Parser.hh (also in --check mode), Part_5/Compiler.hh and
+	Parts_1_2/Assembler.hh on it, each in its own process (see Run.hh). The VM
+	translator is run on the output of the compiler, together with the minimal OS
+	in Benchmarks/OS that the generated code calls, so that the program links.
+
+	Usage:  hhvm Benchmarks/Benchmark.hh [--option=value ...]
+
+	Options:
+	--classes=N          number of generated classes (default 20)
+	--subs=N             functions per class (default 10)
+	--depth=N            if/while and expression nesting depth (default 3)
+	--stmts=N            statements per block (default 6)
+	--seed=N             random seed of the generator (default 2016)
+	--iterations=N       runs per tool; the median time is reported (default 3)
+	--vm-lines=N         also time the VM translator on a single generated VM file
+	                     of about N lines, e.g. 1000000 (default 0, off), normally
+	                     and in --stream mode, whose peak memory should not grow
+	                     with N
+	--out=FILE           where to write the JSON results (default Benchmarks/results.json)
+	--baseline=FILE      stored baseline to compare against (default Benchmarks/baseline.json)
+	--threshold=PERCENT  allowed slowdown / memory growth before failing (default 10)
+	--update-baseline    store the results as the new baseline
+	--stream-check[=MB]  instead of the benchmarks, translate a generated VM file of
+	                     MB megabytes (default 500) in --stream mode and check the
+	                     translator's peak PHP heap and peak resident set size
+	                     (see streamMemoryCheck; the .asm output needs several
+	                     times MB of disk space)
+
+	Exits with status 1 if any tool regressed past the threshold, or if the
+	--stream-check limit was exceeded.
+*/
+function main()
+{
+	$options = parseOptions(array_slice($GLOBALS['argv'], 1));
+	$rootDir = dirname(__DIR__);
+
+	$workDir = sys_get_temp_dir() . '/ekronot_bench_' . getmypid();
+	if (!is_dir($workDir))
+		mkdir($workDir);
+	if (array_key_exists('stream-check', $options)) {
+		$megabytes = ($options['stream-check'] !== '') ? (int)$options['stream-check'] : 500;
+		exit(streamMemoryCheck($rootDir, $workDir, $megabytes) ? 0 : 1);
+	}
+
+	// Generating the corpus
+	mt_srand((int)$options['seed']);
+	$jackTokens = 0;
+	$jackLines = 0;
+	for ($i = 0; $i < (int)$options['classes']; $i++) {
+		$src = generateJackClass("Gen$i", (int)$options['subs'], (int)$options['depth'], (int)$options['stmts']);
+		file_put_contents("$workDir/Gen$i.jack", $src);
+		$jackTokens += countJackTokens($src);
+		$jackLines += substr_count($src, "\n");
+	}
+	echo "Generated " . $options['classes'] . " classes ($jackLines lines, $jackTokens tokens) in $workDir\n";
+
+	$iterations = (int)$options['iterations'];
+	$results = [];
+	$results['parser'] = runStage("$rootDir/Part_4/Parser.hh", ['.'], $workDir, $iterations, $jackTokens, $jackLines);
+	$results['check'] = runStage("$rootDir/Part_4/Parser.hh", ['.', '--check'], $workDir, $iterations, $jackTokens, $jackLines);
+	$results['compiler'] = runStage("$rootDir/Part_5/Compiler.hh", ['.', '--no-cache'], $workDir, $iterations, $jackTokens, $jackLines);
+
+	// The VM translator is measured on what the compiler produced and the OS it calls
+	compileOs($rootDir, $workDir);
+	$vmTokens = 0;
+	$vmLines = 0;
+	foreach (glob("$workDir/*.vm") as $vmFile) {
+		foreach (file($vmFile, FILE_IGNORE_NEW_LINES | FILE_SKIP_EMPTY_LINES) as $line) {
+			$vmTokens += count(explode(' ', trim($line)));
+			$vmLines++;
+		}
+	}
+	$results['assembler'] = runStage("$rootDir/Parts_1_2/Assembler.hh", ['.', 'Bench.asm', '--no-cache'], $workDir, $iterations, $vmTokens, $vmLines);
+
+	// Bulk input: one large VM file, translated without removing its (unreachable) functions
+	if ((int)$options['vm-lines'] > 0) {
+		mkdir("$workDir/bulk");
+		$bulk = generateVmFile("$workDir/bulk/Big.vm", (int)$options['vm-lines']);
+		echo "\nGenerated a VM file of " . $bulk['lines'] . " lines\n";
+		$results['vm-bulk'] = runStage("$rootDir/Parts_1_2/Assembler.hh", ['.', 'Big.asm', '--no-cache'],
+			"$workDir/bulk", $iterations, $bulk['tokens'], $bulk['lines']);
+		$results['vm-stream'] = runStage("$rootDir/Parts_1_2/Assembler.hh", ['.', 'Big.asm', '--stream'],
+			"$workDir/bulk", $iterations, $bulk['tokens'], $bulk['lines']);
+	}
+
+	removeDir($workDir);
+
+	$report = [
+		'config' => [
+			'classes' => (int)$options['classes'],
+			'subs' => (int)$options['subs'],
+			'depth' => (int)$options['depth'],
+			'stmts' => (int)$options['stmts'],
+			'seed' => (int)$options['seed'],
+			'iterations' => $iterations,
+			'vmLines' => (int)$options['vm-lines']
+		],
+		'stages' => $results
+	];
+	file_put_contents($options['out'], json_encode($report, JSON_PRETTY_PRINT) . "\n");
+	echo "\nResults written to " . $options['out'] . "\n";
+
+	$regressed = false;
+	if (file_exists($options['baseline'])) {
+		$baseline = json_decode(file_get_contents($options['baseline']), true);
+		if ($baseline['config'] != $report['config'])
+			echo "Warning: the baseline was recorded with a different configuration\n";
+		$regressed = compareToBaseline($results, $baseline['stages'], (float)$options['threshold']);
+	}
+	else {
+		echo "No baseline found at " . $options['baseline'] . "\n";
+		printResults($results);
+	}
+
+	if (array_key_exists('update-baseline', $options)) {
+		file_put_contents($options['baseline'], json_encode($report, JSON_PRETTY_PRINT) . "\n");
+		echo "Baseline updated\n";
+	}
+
+	exit($regressed ? 1 : 0);
+}
+
+// Turns '--name=value' and '--flag' arguments into an array, filling in the defaults.
+function parseOptions(array $args) : array
+{
+	$options = [
+		'classes' => '20',
+		'subs' => '10',
+		'depth' => '3',
+		'stmts' => '6',
+		'seed' => '2016',
+		'iterations' => '3',
+		'vm-lines' => '0',
+		'out' => __DIR__ . '/results.json',
+		'baseline' => __DIR__ . '/baseline.json',
+		'threshold' => '10'
+	];
+	foreach ($args as $arg) {
+		if (substr($arg, 0, 2) !== '--') {
+			echo "Ignoring unknown argument '$arg'\n";
+			continue;
+		}
+		$parts = explode('=', substr($arg, 2), 2);
+		$options[$parts[0]] = (count($parts) === 2) ? $parts[1] : '';
+	}
+
+	return $options;
+}
+
+// The most PHP heap the VM translator may use in --stream mode, whatever the size of its input
+const STREAM_MEMORY_LIMIT = 64 * 1024 * 1024;
+
+// How much more resident memory a --stream run of the big input may take than one of a 1 MB input
+const STREAM_RSS_GROWTH_LIMIT = 32 * 1024 * 1024;
+
+/*
+	Translates a generated VM file of 1 MB and one of $megabytes MB with
+	Assembler.hh --stream, each in its own process (see Run.hh). Returns whether
+	the big run's peak PHP heap stayed under STREAM_MEMORY_LIMIT and its peak
+	resident set size under the small run's plus STREAM_RSS_GROWTH_LIMIT. The
+	resident set includes the runtime itself, so it is only bounded relative to
+	the small run. Fails where the resident set size cannot be read.
+*/
+function streamMemoryCheck(string $rootDir, string $workDir, int $megabytes) : bool
+{
+	$runs = [];
+	foreach (['small' => 1, 'big' => $megabytes] as $run => $size) {
+		mkdir("$workDir/$run");
+		$bulk = generateVmFile("$workDir/$run/Big.vm", PHP_INT_MAX, $size * 1024 * 1024);
+		echo "Translating a VM file of " . $bulk['lines'] . " lines (" . $bulk['bytes'] . " bytes) in --stream mode...\n";
+		$runs[$run] = runTool("$rootDir/Parts_1_2/Assembler.hh", ['.', 'Big.asm', '--stream'], "$workDir/$run");
+		removeDir("$workDir/$run");
+	}
+	removeDir($workDir);
+
+	$heap = (int)$runs['big']['peakMemoryBytes'];
+	$rss = (int)$runs['big']['peakRssBytes'];
+	$rssLimit = (int)$runs['small']['peakRssBytes'] + STREAM_RSS_GROWTH_LIMIT;
+	$heapPassed = $heap <= STREAM_MEMORY_LIMIT;
+	$rssPassed = $rss >= 0 && (int)$runs['small']['peakRssBytes'] >= 0 && $rss <= $rssLimit;
+	printf("\nPeak PHP heap %d bytes, limit %d bytes: %s\n", $heap, STREAM_MEMORY_LIMIT, $heapPassed ? 'OK' : 'FAILED');
+	if ($rss < 0)
+		echo "Peak resident set size: not available on this system, FAILED\n";
+	else
+		printf("Peak resident set size %d bytes, limit %d bytes: %s\n", $rss, $rssLimit, $rssPassed ? 'OK' : 'FAILED');
+	printf("(%.1f seconds)\n", $runs['big']['seconds']);
+	return $heapPassed && $rssPassed;
+}
+
+/*
+	Compiles the minimal OS in Benchmarks/OS and adds its VM files to $workDir,
+	next to the generated classes, so that the VM translator can link their calls.
+*/
+function compileOs(string $rootDir, string $workDir) : void
+{
+	mkdir("$workDir/os");
+	foreach (glob(__DIR__ . '/OS/*.jack') as $jackFile)
+		copy($jackFile, "$workDir/os/" . basename($jackFile));
+	runTool("$rootDir/Part_5/Compiler.hh", ['.', '--no-cache'], "$workDir/os");
+	foreach (glob("$workDir/os/*.vm") as $vmFile)
+		copy($vmFile, "$workDir/" . basename($vmFile));
+}
+
+/*
+	Writes a VM file of about $numLines lines to $path, or of about $maxBytes
+	bytes if that is smaller: functions of 1000 commands mixing stack,
+	arithmetic, branching and call commands. Returns its line, token and byte
+	counts.
+*/
+function generateVmFile(string $path, int $numLines, int $maxBytes = PHP_INT_MAX) : array
+{
+	$pattern = [
+		'push argument 0', 'push local 0', 'add', 'pop local 1', 'push constant 17',
+		'push local 1', 'lt', 'if-goto SKIP', 'push this 2', 'push that 0', 'sub',
+		'pop temp 0', 'label SKIP', 'push static 3', 'neg', 'call Big.f0 1', 'pop pointer 1'
+	];
+	$lines = 0;
+	$tokens = 0;
+	$bytes = 0;
+	$file = fopen($path, 'w');
+	for ($f = 0; $lines < $numLines && $bytes < $maxBytes; $f++) {
+		$code = "function Big.f$f 2\n";
+		for ($i = 0; $i < 1000; $i++) {
+			$command = $pattern[$i % count($pattern)];
+			if (substr($command, -4) === 'SKIP')
+				$command .= (int)($i / count($pattern)); // labels are unique within the function
+			$code .= "$command\n";
+			$tokens += substr_count($command, ' ') + 1;
+		}
+		$code .= "push constant 0\nreturn\n";
+		$tokens += 7;
+		$lines += 1003;
+		$bytes += strlen($code);
+		fwrite($file, $code);
+	}
+	fclose($file);
+
+	return ['lines' => $lines, 'tokens' => $tokens, 'bytes' => $bytes];
+}
+
+/*
+	Runs $tool $iterations times in $workDir and returns its measurements:
+	the median wall time, the largest peak memory, and the throughput computed
+	from the given token and line counts.
+*/
+function runStage(string $tool, array $toolArgs, string $workDir, int $iterations, int $tokens, int $lines) : array
+{
+	echo "\nBenchmarking " . basename($tool) . "...\n";
+	$times = [];
+	$peakMemory = 0;
+	for ($i = 0; $i < $iterations; $i++) {
+		$measurement = runTool($tool, $toolArgs, $workDir);
+		$times[] = $measurement['seconds'];
+		$peakMemory = max($peakMemory, (int)$measurement['peakMemoryBytes']);
+	}
+	sort($times);
+	$seconds = $times[(int)(count($times) / 2)];
+
+	return [
+		'seconds' => $seconds,
+		'tokens' => $tokens,
+		'lines' => $lines,
+		'tokensPerSecond' => ($seconds > 0) ? $tokens / $seconds : 0,
+		'linesPerSecond' => ($seconds > 0) ? $lines / $seconds : 0,
+		'peakMemoryBytes' => $peakMemory
+	];
+}
+
+// Runs a tool once through Run.hh and returns the measurement it reported.
+function runTool(string $tool, array $toolArgs, string $workDir) : array
+{
+	$command = escapeshellarg(PHP_BINARY) . ' ' . escapeshellarg(__DIR__ . '/Run.hh') . ' ' . escapeshellarg($tool);
+	foreach ($toolArgs as $arg)
+		$command .= ' ' . escapeshellarg($arg);
+
+	$descriptors = [
+		0 => ['file', '/dev/null', 'r'],
+		1 => ['file', '/dev/null', 'w'],
+		2 => ['pipe', 'w']
+	];
+	$process = proc_open($command, $descriptors, $pipes, $workDir);
+	if (!is_resource($process))
+		throw new Exception("Could not run $tool");
+	$stderr = stream_get_contents($pipes[2]);
+	fclose($pipes[2]);
+	proc_close($process);
+
+	if (!preg_match('/^@@bench (.*)$/m', $stderr, $match))
+		throw new Exception("$tool did not report a measurement:\n$stderr");
+
+	return json_decode($match[1], true);
+}
+
+/*
+	Prints the results next to the baseline and returns true if any tool's
+	throughput dropped, or its peak memory grew, by more than $threshold percent.
+*/
+function compareToBaseline(array $results, array $baseline, float $threshold) : bool
+{
+	$regressed = false;
+	printf("\n%-10s %16s %16s %9s %14s %14s %9s\n", 'stage', 'tokens/s', 'baseline', 'change', 'peak bytes', 'baseline', 'change');
+	foreach ($results as $stage => $result) {
+		if (!array_key_exists($stage, $baseline)) {
+			printf("%-10s %16.0f %16s\n", $stage, $result['tokensPerSecond'], '-');
+			continue;
+		}
+		$base = $baseline[$stage];
+		$speedChange = percentChange($result['tokensPerSecond'], $base['tokensPerSecond']);
+		$memoryChange = percentChange($result['peakMemoryBytes'], $base['peakMemoryBytes']);
+		$flag = '';
+		if ($speedChange < -$threshold || $memoryChange > $threshold) {
+			$flag = '  REGRESSION';
+			$regressed = true;
+		}
+		printf("%-10s %16.0f %16.0f %+8.1f%% %14d %14d %+8.1f%%%s\n", $stage,
+			$result['tokensPerSecond'], $base['tokensPerSecond'], $speedChange,
+			$result['peakMemoryBytes'], $base['peakMemoryBytes'], $memoryChange, $flag);
+	}
+
+	return $regressed;
+}
+
+function printResults(array $results) : void
+{
+	printf("\n%-10s %10s %16s %16s %14s\n", 'stage', 'seconds', 'tokens/s', 'lines/s', 'peak bytes');
+	foreach ($results as $stage => $result) {
+		printf("%-10s %10.3f %16.0f %16.0f %14d\n", $stage, $result['seconds'],
+			$result['tokensPerSecond'], $result['linesPerSecond'], $result['peakMemoryBytes']);
+	}
+}
+
+function percentChange($value, $base) : float
+{
+	return ($base == 0) ? 0.0 : 100.0 * ($value - $base) / $base;
+}
+
+function removeDir(string $dir) : void
+{
+	foreach (scandir($dir) as $entry) {
+		if ($entry === '.' || $entry === '..')
+			continue;
+		if (is_dir("$dir/$entry"))
+			removeDir("$dir/$entry");
+		else
+			unlink("$dir/$entry");
+	}
+	rmdir($dir);
+}
+
+main();
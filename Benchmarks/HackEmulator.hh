@@ -0,0 +1,215 @@
+<?hh //strict
+
+/*
+	A headless emulator of the Hack computer. It loads Hack assembly (as
+	written by Parts_1_2/Assembler.hh), resolves labels and variables the same
+	way the Hack assembler does, and executes it while counting cycles.
+
+	Instructions are decoded once into integers: an A-instruction is its value
+	(always < 0x8000), a C-instruction is 0x8000 | comp << 6 | dest << 3 | jump,
+	where comp is an index into the table below.
+*/
+class HackEmulator {
+	// Computations, indexed by their code. Commutative aliases map to the same code.
+	private static array<string, int> $compCodes = [
+		'0' => 0, '1' => 1, '-1' => 2, 'D' => 3, 'A' => 4, '!D' => 5, '!A' => 6,
+		'-D' => 7, '-A' => 8, 'D+1' => 9, 'A+1' => 10, 'D-1' => 11, 'A-1' => 12,
+		'D+A' => 13, 'A+D' => 13, 'D-A' => 14, 'A-D' => 15, 'D&A' => 16, 'A&D' => 16,
+		'D|A' => 17, 'A|D' => 17, 'M' => 18, '!M' => 19, '-M' => 20, 'M+1' => 21,
+		'M-1' => 22, 'D+M' => 23, 'M+D' => 23, 'D-M' => 24, 'M-D' => 25, 'D&M' => 26,
+		'M&D' => 26, 'D|M' => 27, 'M|D' => 27
+	];
+	private static array<string, int> $jumpCodes = [
+		'JGT' => 1, 'JEQ' => 2, 'JGE' => 3, 'JLT' => 4, 'JNE' => 5, 'JLE' => 6, 'JMP' => 7
+	];
+
+	private array<int> $rom;
+	private array<int> $ram;
+	private array<string, int> $labels;
+	private int $maxStackPointer;
+
+	public function __construct(string $asm)
+	{
+		$this->rom = [];
+		$this->ram = array_fill(0, 32768, 0);
+		$this->labels = [];
+		$this->maxStackPointer = 0;
+		$this->load($asm);
+	}
+
+	/*
+		Two passes, like the Hack assembler: the first records the ROM address of
+		every label, the second decodes the instructions and gives every other
+		symbol a RAM address starting at 16.
+	*/
+	private function load(string $asm) : void
+	{
+		$lines = [];
+		foreach (explode("\n", $asm) as $line) {
+			if (($pos = strpos($line, '//')) !== false)
+				$line = substr($line, 0, $pos);
+			$line = trim($line);
+			if ($line === '')
+				continue;
+			if ($line[0] === '(')
+				$this->labels[substr($line, 1, -1)] = count($lines);
+			else
+				$lines[] = $line;
+		}
+
+		$symbols = [
+			'SP' => 0, 'LCL' => 1, 'ARG' => 2, 'THIS' => 3, 'THAT' => 4,
+			'SCREEN' => 16384, 'KBD' => 24576
+		];
+		for ($i = 0; $i < 16; $i++)
+			$symbols["R$i"] = $i;
+		$nextVariable = 16;
+
+		foreach ($lines as $line) {
+			if ($line[0] === '@') {
+				$symbol = substr($line, 1);
+				if (ctype_digit($symbol))
+					$this->rom[] = (int)$symbol;
+				else if (array_key_exists($symbol, $this->labels))
+					$this->rom[] = $this->labels[$symbol];
+				else {
+					if (!array_key_exists($symbol, $symbols))
+						$symbols[$symbol] = $nextVariable++;
+					$this->rom[] = $symbols[$symbol];
+				}
+				continue;
+			}
+
+			$dest = '';
+			$jump = '';
+			if (($pos = strpos($line, '=')) !== false) {
+				$dest = substr($line, 0, $pos);
+				$line = substr($line, $pos + 1);
+			}
+			if (($pos = strpos($line, ';')) !== false) {
+				$jump = substr($line, $pos + 1);
+				$line = substr($line, 0, $pos);
+			}
+			if (!array_key_exists($line, self::$compCodes))
+				throw new Exception("Unknown computation '$line'");
+			$destBits = ((strpos($dest, 'A') !== false) ? 4 : 0)
+				| ((strpos($dest, 'D') !== false) ? 2 : 0)
+				| ((strpos($dest, 'M') !== false) ? 1 : 0);
+			$jumpBits = ($jump === '') ? 0 : self::$jumpCodes[$jump];
+			$this->rom[] = 0x8000 | (self::$compCodes[$line] << 6) | ($destBits << 3) | $jumpBits;
+		}
+	}
+
+	public function romSize() : int
+	{
+		return count($this->rom);
+	}
+
+	// Returns the ROM address of a label, or -1 if it is not defined.
+	public function labelAddress(string $label) : int
+	{
+		return array_key_exists($label, $this->labels) ? $this->labels[$label] : -1;
+	}
+
+	public function peek(int $address) : int
+	{
+		return $this->ram[$address];
+	}
+
+	public function poke(int $address, int $value) : void
+	{
+		$this->ram[$address] = $value;
+	}
+
+	// The deepest the Stack got, in words above its base (RAM[256]).
+	public function maxStackDepth() : int
+	{
+		return max(0, $this->maxStackPointer - 256);
+	}
+
+	/*
+		Runs from ROM[0] until the program counter reaches $haltAddress, runs off
+		the end of the ROM, or $maxCycles instructions were executed.
+
+		Return Value:
+		The number of instructions executed.
+	*/
+	public function run(int $maxCycles, int $haltAddress) : int
+	{
+		$rom = $this->rom;
+		$ram = $this->ram;
+		$romSize = count($rom);
+		$maxSP = $ram[0];
+		$pc = 0;
+		$a = 0;
+		$d = 0;
+		$cycles = 0;
+
+		while ($cycles < $maxCycles && $pc !== $haltAddress && $pc < $romSize) {
+			$ins = $rom[$pc];
+			$cycles++;
+			if ($ins < 0x8000) {
+				$a = $ins;
+				$pc++;
+				continue;
+			}
+
+			switch (($ins >> 6) & 0x3F) {
+			case 0: $v = 0; break;
+			case 1: $v = 1; break;
+			case 2: $v = -1; break;
+			case 3: $v = $d; break;
+			case 4: $v = $a; break;
+			case 5: $v = ~$d; break;
+			case 6: $v = ~$a; break;
+			case 7: $v = -$d; break;
+			case 8: $v = -$a; break;
+			case 9: $v = $d + 1; break;
+			case 10: $v = $a + 1; break;
+			case 11: $v = $d - 1; break;
+			case 12: $v = $a - 1; break;
+			case 13: $v = $d + $a; break;
+			case 14: $v = $d - $a; break;
+			case 15: $v = $a - $d; break;
+			case 16: $v = $d & $a; break;
+			case 17: $v = $d | $a; break;
+			case 18: $v = $ram[$a]; break;
+			case 19: $v = ~$ram[$a]; break;
+			case 20: $v = -$ram[$a]; break;
+			case 21: $v = $ram[$a] + 1; break;
+			case 22: $v = $ram[$a] - 1; break;
+			case 23: $v = $d + $ram[$a]; break;
+			case 24: $v = $d - $ram[$a]; break;
+			case 25: $v = $ram[$a] - $d; break;
+			case 26: $v = $d & $ram[$a]; break;
+			default: $v = $d | $ram[$a]; break;
+			}
+			// wrap to a signed 16 bit value
+			$v &= 0xFFFF;
+			if ($v >= 0x8000)
+				$v -= 0x10000;
+
+			$target = $a;
+			if ($ins & 8) {
+				$ram[$a] = $v;
+				if ($a === 0 && $v > $maxSP)
+					$maxSP = $v;
+			}
+			if ($ins & 32)
+				$a = $v;
+			if ($ins & 16)
+				$d = $v;
+
+			$jump = $ins & 7;
+			if ($jump !== 0 && ((($jump & 4) && $v < 0) || (($jump & 2) && $v === 0) || (($jump & 1) && $v > 0)))
+				$pc = $target;
+			else
+				$pc++;
+		}
+
+		$this->ram = $ram;
+		$this->maxStackPointer = $maxSP;
+
+		return $cycles;
+	}
+}
@@ -0,0 +1,130 @@
+<?hh //decl
+
+// Generates synthetic Jack classes for the throughput benchmarks
+
+/*
+	Returns the source of a synthetic Jack class. The class has a handful of
+	fields and statics, a constructor, a method, and $numSubs functions whose
+	bodies contain $numStmts statements per block, with if/while blocks and
+	parenthesised expressions nested up to $depth levels.
+
+	Every class only references its own variables and functions, so the
+	output is accepted by both Part_4/Parser.hh and Part_5/Compiler.hh.
+*/
+function generateJackClass(string $className, int $numSubs, int $depth, int $numStmts) : string
+{
+	$retString = "// Generated benchmark class $className\n";
+	$retString .= "class $className {\n";
+	$retString .= "\tfield int f0, f1, f2;\n";
+	$retString .= "\tfield Array fa;\n";
+	$retString .= "\tstatic int s0, s1;\n\n";
+
+	$retString .= "\tconstructor $className new(int a0) {\n";
+	$retString .= "\t\tlet f0 = a0;\n\t\tlet f1 = a0 + 1;\n\t\tlet f2 = 0;\n";
+	$retString .= "\t\tlet fa = Array.new(8);\n";
+	$retString .= "\t\treturn this;\n\t}\n\n";
+
+	$retString .= "\t/** Returns the sum of the first two fields. */\n";
+	$retString .= "\tmethod int get() {\n\t\treturn f0 + f1;\n\t}\n\n";
+
+	for ($i = 0; $i < $numSubs; $i++) {
+		$retString .= generateJackFunction($className, $i, $numSubs, $depth, $numStmts);
+	}
+	$retString .= "}\n";
+
+	return $retString;
+}
+
+// Returns one 'function int subN(int a0, int a1)' declaration.
+function generateJackFunction(string $className, int $subIndex, int $numSubs, int $depth, int $numStmts) : string
+{
+	$retString = "\tfunction int sub$subIndex(int a0, int a1) {\n";
+	$retString .= "\t\tvar int v0, v1, v2;\n";
+	$retString .= "\t\tvar Array va;\n";
+	$retString .= "\t\tvar String vs;\n";
+	$retString .= "\t\tlet va = Array.new(16);\n";
+	$retString .= generateJackStatements($className, $numSubs, $depth, $numStmts, 2);
+	$retString .= "\t\treturn v0;\n";
+	$retString .= "\t}\n\n";
+
+	return $retString;
+}
+
+// Returns a block of $numStmts statements indented by $tabs tab characters.
+function generateJackStatements(string $className, int $numSubs, int $depth, int $numStmts, int $tabs) : string
+{
+	$ind = str_repeat("\t", $tabs);
+	$retString = '';
+	for ($i = 0; $i < $numStmts; $i++) {
+		$choice = ($depth > 0) ? mt_rand(0, 6) : mt_rand(0, 4);
+		switch ($choice) {
+		case 0:
+			$retString .= $ind . 'let v' . mt_rand(0, 2) . ' = ' . generateJackExpression($depth) . ";\n";
+			break;
+		case 1:
+			$retString .= $ind . 'let va[' . generateJackExpression(0) . '] = ' . generateJackExpression($depth) . ";\n";
+			break;
+		case 2:
+			$retString .= $ind . 'let s' . mt_rand(0, 1) . ' = va[v' . mt_rand(0, 2) . '] + ' . generateJackExpression($depth) . ";\n";
+			break;
+		case 3:
+			$retString .= $ind . "do $className.sub" . mt_rand(0, $numSubs - 1) . '(' . generateJackExpression(0)
+				. ', ' . generateJackExpression(0) . ");\n";
+			break;
+		case 4:
+			$retString .= $ind . "let vs = \"generated text\";\n";
+			break;
+		case 5:
+			$retString .= $ind . 'if (' . generateJackExpression($depth - 1) . " < 100) {\n";
+			$retString .= generateJackStatements($className, $numSubs, $depth - 1, $numStmts, $tabs + 1);
+			$retString .= $ind . "}\n";
+			$retString .= $ind . "else {\n";
+			$retString .= generateJackStatements($className, $numSubs, $depth - 1, $numStmts, $tabs + 1);
+			$retString .= $ind . "}\n";
+			break;
+		case 6:
+			$retString .= $ind . "// loop at depth $depth\n";
+			$retString .= $ind . 'while (~(v' . mt_rand(0, 2) . " = 0)) {\n";
+			$retString .= generateJackStatements($className, $numSubs, $depth - 1, $numStmts, $tabs + 1);
+			$retString .= $ind . "\tlet v0 = v0 - 1;\n";
+			$retString .= $ind . "}\n";
+			break;
+		}
+	}
+
+	return $retString;
+}
+
+// Returns an expression whose parentheses are nested up to $depth levels.
+function generateJackExpression(int $depth) : string
+{
+	$terms = ['a0', 'a1', 'v0', 'v1', 'v2', 's0', 's1', '7', '42', '-3', 'va[a0]', 'true', 'null'];
+	$ops = ['+', '-', '*', '/', '&', '|'];
+
+	$retString = $terms[mt_rand(0, count($terms) - 1)];
+	$numOps = mt_rand(0, 2);
+	for ($i = 0; $i < $numOps; $i++) {
+		$operand = ($depth > 0 && mt_rand(0, 1) === 1)
+			? '(' . generateJackExpression($depth - 1) . ')'
+			: $terms[mt_rand(0, count($terms) - 1)];
+		$retString .= ' ' . $ops[mt_rand(0, count($ops) - 1)] . ' ' . $operand;
+	}
+
+	return $retString;
+}
+
+/*
+	Counts the Jack tokens in $str, skipping comments. Used to report tokens
+	per second independently of the tokenizer being measured.
+*/
+function countJackTokens(string $str) : int
+{
+	preg_match_all('#//[^\n]*|/\*.*?\*/|"[^"\n]*"|\d+|[a-zA-Z_]\w*|[{}()\[\].,;+\-*/&|<>=~]#s', $str, $matches);
+	$count = 0;
+	foreach ($matches[0] as $tok) {
+		if (substr($tok, 0, 2) !== '//' && substr($tok, 0, 2) !== '/*')
+			$count++;
+	}
+
+	return $count;
+}
@@ -0,0 +1,33 @@
+<?hh //decl
+
+/*
+	Runs one of the course tools and reports how long it took and how much
+	memory it used: the peak of the PHP heap, and the peak resident set size of
+	the process as the kernel reports it (VmHWM in /proc/self/status, -1 where
+	there is none). Used by Benchmark.hh so that every tool is measured in its
+	own process.
+
+	Usage:  hhvm Run.hh <tool.hh> [tool arguments...]
+
+	The measurement is written to STDERR as a single line starting with '@@bench '
+	followed by a JSON object.
+*/
+
+$benchStart = microtime(true);
+$benchTool = $argv[1];
+
+// The tool reads its own arguments from $argv, so hide this script from it
+$GLOBALS['argv'] = array_slice($argv, 1);
+$GLOBALS['argc'] = count($GLOBALS['argv']);
+
+register_shutdown_function(function() use ($benchStart) {
+	$status = @file_get_contents('/proc/self/status');
+	$peakRss = ($status !== false && preg_match('/^VmHWM:\s+(\d+) kB/m', $status, $match)) ? (int)$match[1] * 1024 : -1;
+	fwrite(STDERR, "\n@@bench " . json_encode([
+		'seconds' => microtime(true) - $benchStart,
+		'peakMemoryBytes' => memory_get_peak_usage(true),
+		'peakRssBytes' => $peakRss
+	]) . "\n");
+});
+
+include($benchTool);
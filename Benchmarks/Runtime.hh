@@ -0,0 +1,191 @@
+<?hh //decl
+
+// Runtime benchmarks: Jack programs measured in emulated Hack cycles
+
+include('HackEmulator.hh');
+
+/*
+	Compiles every program in Benchmarks/Programs together with the minimal OS
+	in Benchmarks/OS using Part_5/Compiler.hh, translates the result with
+	Parts_1_2/Assembler.hh, and runs it in the Hack emulator until it reaches
+	Sys.halt. For each program it reports the value returned by Main.main, the
+	number of cycles executed, how many of them ran before Main.main was entered
+	(the OS start-up, '-' if Main.main was inlined), the ROM size and the maximum
+	Stack depth.
+
+	The output only depends on the generated code, so it can be diffed between
+	commits to judge code generation changes. The value of every program in
+	EXPECTED_RESULTS is checked, which also validates the emulator itself.
+
+	Usage:  hhvm Benchmarks/Runtime.hh [--option=value ...] [program ...]
+
+	Options:
+	--max-cycles=N              stop a program after N cycles (default 50000000)
+	--out=FILE                  also write the table to FILE
+	--compiler-flags='FLAGS'    extra options passed to Part_5/Compiler.hh
+	--translator-flags='FLAGS'  extra options passed to Parts_1_2/Assembler.hh
+	--check-flags='FLAGS'       also build every program with these translator
+	                            options added, e.g. '--optimize', and check that it
+	                            returns the same result and leaves the same heap
+	                            (RAM 2048-16383); the cycles and ROM size of that
+	                            build are shown next to the others
+
+	Exits with status 1 if a program fails to build, does not halt, returns
+	another value than EXPECTED_RESULTS gives for it, or behaves differently
+	with --check-flags.
+*/
+function main()
+{
+	$rootDir = dirname(__DIR__);
+	$maxCycles = 50000000;
+	$outFile = '';
+	$flags = ['compiler' => [], 'translator' => []];
+	$checkFlags = [];
+	$programs = [];
+	foreach (array_slice($GLOBALS['argv'], 1) as $arg) {
+		if (substr($arg, 0, 13) === '--max-cycles=')
+			$maxCycles = (int)substr($arg, 13);
+		else if (substr($arg, 0, 6) === '--out=')
+			$outFile = substr($arg, 6);
+		else if (substr($arg, 0, 17) === '--compiler-flags=')
+			$flags['compiler'] = preg_split('/\s+/', substr($arg, 17), -1, PREG_SPLIT_NO_EMPTY);
+		else if (substr($arg, 0, 19) === '--translator-flags=')
+			$flags['translator'] = preg_split('/\s+/', substr($arg, 19), -1, PREG_SPLIT_NO_EMPTY);
+		else if (substr($arg, 0, 14) === '--check-flags=')
+			$checkFlags = preg_split('/\s+/', substr($arg, 14), -1, PREG_SPLIT_NO_EMPTY);
+		else
+			$programs[] = $arg;
+	}
+	if (count($programs) === 0) {
+		foreach (scandir(__DIR__ . '/Programs') as $entry) {
+			if ($entry !== '.' && $entry !== '..' && is_dir(__DIR__ . "/Programs/$entry"))
+				$programs[] = $entry;
+		}
+	}
+	sort($programs);
+
+	$table = sprintf("%-12s %10s %12s %8s %8s %8s", 'program', 'result', 'cycles', 'startup', 'rom', 'stack');
+	if (count($checkFlags) > 0)
+		$table .= sprintf(" %12s %8s %s", 'cycles*', 'rom*', 'check');
+	$table .= "\n";
+	$failed = false;
+	foreach ($programs as $program) {
+		try {
+			$row = runProgram($rootDir, $program, $maxCycles, $flags);
+			$table .= sprintf("%-12s %10d %12d %8s %8d %8d", $program, $row['result'], $row['cycles'],
+				($row['startup'] < 0) ? '-' : $row['startup'], $row['rom'], $row['stack']);
+			if (count($checkFlags) > 0) {
+				$checkRow = runProgram($rootDir, $program, $maxCycles,
+					['compiler' => $flags['compiler'], 'translator' => array_merge($flags['translator'], $checkFlags)]);
+				$same = $checkRow['result'] === $row['result'] && $checkRow['heap'] === $row['heap']
+					&& $checkRow['halted'] === $row['halted'];
+				$failed = $failed || !$same;
+				$table .= sprintf(" %12d %8d %s", $checkRow['cycles'], $checkRow['rom'], $same ? 'same' : 'DIFFERENT');
+			}
+			$wrong = array_key_exists($program, EXPECTED_RESULTS) && $row['result'] !== EXPECTED_RESULTS[$program];
+			$failed = $failed || $wrong || !$row['halted'];
+			if ($wrong)
+				$table .= '  (expected ' . EXPECTED_RESULTS[$program] . ')';
+			$table .= ($row['halted'] ? '' : '  (did not halt)') . "\n";
+		}
+		catch (Exception $e) {
+			$table .= sprintf("%-12s %s\n", $program, 'FAILED: ' . $e->getMessage());
+			$failed = true;
+		}
+	}
+
+	echo $table;
+	if ($outFile !== '')
+		file_put_contents($outFile, $table);
+	exit($failed ? 1 : 0);
+}
+
+// What Main.main of each program returns, worked out from its Jack source
+const EXPECTED_RESULTS = [
+	'ArrayLoops' => 288,
+	'HeapChurn' => 3716,
+	'Recursion' => 5660,
+	'Sort' => 462,
+	'Strings' => 770
+];
+
+/*
+	Builds and runs one program. Returns its result, cycle count, start-up cycle
+	count, ROM size, maximum Stack depth, a hash of the heap it leaves and whether
+	it reached Sys.halt.
+*/
+function runProgram(string $rootDir, string $program, int $maxCycles, array $flags) : array
+{
+	$workDir = sys_get_temp_dir() . '/ekronot_runtime_' . getmypid() . "_$program";
+	if (!is_dir($workDir))
+		mkdir($workDir);
+
+	$jackFiles = array_merge(glob(__DIR__ . '/OS/*.jack'), glob(__DIR__ . "/Programs/$program/*.jack"));
+	foreach ($jackFiles as $jackFile)
+		copy($jackFile, "$workDir/" . basename($jackFile));
+
+	runTool("$rootDir/Part_5/Compiler.hh", array_merge(['.', '--no-cache'], $flags['compiler']), $workDir);
+	if (count(glob("$workDir/*.vm")) !== count($jackFiles)) {
+		removeDir($workDir);
+		throw new Exception('compilation failed');
+	}
+	runTool("$rootDir/Parts_1_2/Assembler.hh", array_merge(['.', "$program.asm", '--no-cache'], $flags['translator']), $workDir);
+	$asm = file_get_contents("$workDir/$program.asm");
+	removeDir($workDir);
+
+	// The start-up is measured by a separate run that stops where Main.main starts
+	$startup = new HackEmulator($asm);
+	$mainAddress = $startup->labelAddress('Main.main');
+	$startupCycles = ($mainAddress < 0) ? -1 : $startup->run($maxCycles, $mainAddress);
+
+	$emulator = new HackEmulator($asm);
+	$haltAddress = $emulator->labelAddress('Sys.halt');
+	$cycles = $emulator->run($maxCycles, $haltAddress);
+	$result = $emulator->peek(16383);
+	$heap = '';
+	for ($address = 2048; $address < 16384; $address++)
+		$heap .= $emulator->peek($address) . ' ';
+
+	return [
+		'result' => $result,
+		'cycles' => $cycles,
+		'startup' => $startupCycles,
+		'rom' => $emulator->romSize(),
+		'stack' => $emulator->maxStackDepth(),
+		'heap' => sha1($heap),
+		'halted' => $cycles < $maxCycles
+	];
+}
+
+// Runs one of the course tools in $workDir, discarding its console output.
+function runTool(string $tool, array $toolArgs, string $workDir) : void
+{
+	$command = escapeshellarg(PHP_BINARY) . ' ' . escapeshellarg($tool);
+	foreach ($toolArgs as $arg)
+		$command .= ' ' . escapeshellarg($arg);
+
+	$descriptors = [
+		0 => ['file', '/dev/null', 'r'],
+		1 => ['file', '/dev/null', 'w'],
+		2 => ['file', '/dev/null', 'w']
+	];
+	$process = proc_open($command, $descriptors, $pipes, $workDir);
+	if (!is_resource($process))
+		throw new Exception("could not run $tool");
+	proc_close($process);
+}
+
+function removeDir(string $dir) : void
+{
+	foreach (scandir($dir) as $entry) {
+		if ($entry === '.' || $entry === '..')
+			continue;
+		if (is_dir("$dir/$entry"))
+			removeDir("$dir/$entry");
+		else
+			unlink("$dir/$entry");
+	}
+	rmdir($dir);
+}
+
+main();
@@ -0,0 +1,85 @@
+<?hh //decl
+
+// Microbenchmark of symbol lookups in Part_5/SymbolTable.hh
+
+include(__DIR__ . '/../Part_5/SymbolTable.hh');
+
+/*
+	The previous symbol table, kept here as the point of comparison: string-keyed
+	nested records, one table per scope, and a lookup that asks each scope
+	isDefined() before reading each field separately.
+*/
+class LegacySymbolTable {
+	private array<string, int> $indices;
+	private array<string, array<string, mixed>> $table;
+
+	public function __construct()
+	{
+		$this->indices = ['static' => 0, 'field' => 0, 'arg' => 0, 'var' => 0];
+		$this->table = [];
+	}
+
+	public function define(string $name, string $type, string $kind) : void
+	{
+		$this->table[$name] = ['type' => $type, 'kind' => $kind, 'index' => $this->indices[$kind]];
+		$this->indices[$kind]++;
+	}
+
+	public function kindOf(string $name) : string { return (string)$this->table[$name]['kind']; }
+	public function indexOf(string $name) : int { return (int)$this->table[$name]['index']; }
+	public function isDefined(string $name) : bool { return array_key_exists($name, $this->table); }
+}
+
+/*
+	Usage:  hhvm Benchmarks/SymbolTableBench.hh [lookups]
+
+	Defines a class scope of 16 fields and statics and a subroutine scope of 16
+	arguments and locals, then resolves a mix of names from both scopes the way
+	Compiler.hh does for every variable reference, and prints lookups per second.
+*/
+function main()
+{
+	$lookups = (count($GLOBALS['argv']) > 1) ? (int)$GLOBALS['argv'][1] : 1000000;
+
+	$names = [];
+	$classTable = new SymbolTable();
+	$subTable = new SymbolTable($classTable);
+	$legacyClass = new LegacySymbolTable();
+	$legacySub = new LegacySymbolTable();
+	for ($i = 0; $i < 8; $i++) {
+		foreach (["field$i" => 'field', "count$i" => 'static'] as $name => $kind) {
+			$classTable->define($name, 'int', $kind);
+			$legacyClass->define($name, 'int', $kind);
+			$names[] = $name;
+		}
+		foreach (["param$i" => 'arg', "local$i" => 'var'] as $name => $kind) {
+			$subTable->define($name, 'int', $kind);
+			$legacySub->define($name, 'int', $kind);
+			$names[] = $name;
+		}
+	}
+	$numNames = count($names);
+
+	$start = microtime(true);
+	$checksum = 0;
+	for ($i = 0; $i < $lookups; $i++) {
+		$symbol = $subTable->lookup($names[$i % $numNames]);
+		$checksum += $symbol[SymbolTable::INDEX];
+	}
+	$seconds = microtime(true) - $start;
+	printf("%-10s %14.0f lookups/s  (checksum %d)\n", 'chained', $lookups / $seconds, $checksum);
+
+	$start = microtime(true);
+	$checksum = 0;
+	for ($i = 0; $i < $lookups; $i++) {
+		$name = $names[$i % $numNames];
+		$table = $legacySub->isDefined($name) ? $legacySub : $legacyClass;
+		$kind = $table->kindOf($name);
+		$table = $legacySub->isDefined($name) ? $legacySub : $legacyClass;
+		$checksum += $table->indexOf($name);
+	}
+	$seconds = microtime(true) - $start;
+	printf("%-10s %14.0f lookups/s  (checksum %d)\n", 'legacy', $lookups / $seconds, $checksum);
+}
+
+main();
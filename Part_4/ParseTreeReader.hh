@@ -0,0 +1,158 @@
+<?hh //strict
+
+/*
+	Reads the binary parse trees written by Parser.hh --format=binary (*S.jpt).
+
+	A file starts with the 4 bytes "JPT1" followed by a stream of records, each
+	starting with a record type byte:
+
+	STRING  <length> <bytes>        defines the next string id (ids count from 0)
+	BEGIN   <name id>               starts a node, e.g. 'letStatement'
+	CLOSE                           ends the innermost open node
+	TOKEN   <type> <value id> <offset>
+	                                a token: its type (a byte, see TOKEN_TYPES), its
+	                                value (string constants without their quotes) and
+	                                its byte offset in the .jack file
+	END                             ends the file
+
+	Numbers other than the type bytes are unsigned LEB128 varints. A string is
+	defined right before the first record that uses it, so files can be written
+	and read in a single pass.
+*/
+class ParseTreeReader {
+	const string MAGIC = 'JPT1';
+
+	const int END = 0;
+	const int BEGIN = 1;
+	const int CLOSE = 2;
+	const int TOKEN = 3;
+	const int STRING = 4;
+
+	const array<int, string> TOKEN_TYPES = [
+		1 => 'integerConstant',
+		2 => 'stringConstant',
+		3 => 'symbol',
+		4 => 'keyword',
+		5 => 'identifier'
+	];
+
+	// Bytes read from the file at a time
+	const int CHUNK_SIZE = 65536;
+
+	private resource $handle;
+	private string $buffer;
+	private int $pos;
+	private array<string> $strings;
+	private array<string> $openNodes;
+
+	public function __construct(resource $handle)
+	{
+		$this->handle = $handle;
+		$this->buffer = '';
+		$this->pos = 0;
+		$this->strings = [];
+		$this->openNodes = [];
+		if ($this->bytes(4) !== self::MAGIC)
+			throw new Exception('Not a binary parse tree');
+	}
+
+	public static function open(string $fileName) : ParseTreeReader
+	{
+		$handle = fopen($fileName, 'rb');
+		if ($handle === false)
+			throw new Exception("Could not open $fileName");
+		return new ParseTreeReader($handle);
+	}
+
+	/*
+		Returns the next event of the tree, or null after the last one:
+
+		['begin', name]
+		['end', name]
+		['token', type, value, offset]
+	*/
+	public function next() : ?array
+	{
+		while (true) {
+			switch ($this->byte()) {
+			case self::STRING:
+				$this->strings[] = $this->bytes($this->varint());
+				break;
+			case self::BEGIN:
+				$name = $this->strings[$this->varint()];
+				$this->openNodes[] = $name;
+				return ['begin', $name];
+			case self::CLOSE:
+				return ['end', array_pop($this->openNodes)];
+			case self::TOKEN:
+				$type = self::TOKEN_TYPES[$this->byte()];
+				$value = $this->strings[$this->varint()];
+				return ['token', $type, $value, $this->varint()];
+			case self::END:
+				return null;
+			default:
+				throw new Exception('Corrupt binary parse tree');
+			}
+		}
+	}
+
+	/*
+		Reads the rest of the tree into nested arrays. A node is
+		['name' => name, 'children' => [...]] and a token is
+		['type' => type, 'value' => value, 'offset' => offset].
+	*/
+	public function readTree() : ?array
+	{
+		$stack = [['name' => '', 'children' => []]];
+		while (($event = $this->next()) !== null) {
+			switch ($event[0]) {
+			case 'begin':
+				$stack[] = ['name' => $event[1], 'children' => []];
+				break;
+			case 'end':
+				$node = array_pop($stack);
+				$stack[count($stack) - 1]['children'][] = $node;
+				break;
+			case 'token':
+				$stack[count($stack) - 1]['children'][] =
+					['type' => $event[1], 'value' => $event[2], 'offset' => $event[3]];
+				break;
+			}
+		}
+
+		$roots = $stack[0]['children'];
+		return (count($roots) > 0) ? $roots[0] : null;
+	}
+
+	private function byte() : int
+	{
+		return ord($this->bytes(1));
+	}
+
+	private function varint() : int
+	{
+		$value = 0;
+		$shift = 0;
+		do {
+			$byte = $this->byte();
+			$value |= ($byte & 0x7F) << $shift;
+			$shift += 7;
+		} while ($byte & 0x80);
+		return $value;
+	}
+
+	// Returns the next $length bytes, reading more of the file as needed.
+	private function bytes(int $length) : string
+	{
+		while (strlen($this->buffer) - $this->pos < $length) {
+			$chunk = fread($this->handle, max(self::CHUNK_SIZE, $length));
+			if ($chunk === false || $chunk === '')
+				throw new Exception('Unexpected end of binary parse tree');
+			$this->buffer = substr($this->buffer, $this->pos) . $chunk;
+			$this->pos = 0;
+		}
+		$bytes = substr($this->buffer, $this->pos, $length);
+		$this->pos += $length;
+		return $bytes;
+	}
+}
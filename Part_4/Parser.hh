@@ -1,130 +1,294 @@
 <?hh //decl
 
-// Parses Jack into XML
+// Parses Jack into XML (or a binary parse tree)
+
+include('ParseTreeReader.hh');
+include(__DIR__ . '/../Part_5/Stats.hh');
 
 /*
 This main is in charge of looping through all of the .jack files in a source
 directory and writing the parsed output into respective .xml files.
+
+Errors are reported with their line and column. After an error in a statement
+or declaration the parser skips ahead to the next ';' or '}' and goes on, so all
+of the errors in a file are reported in one run, up to --max-errors of them
+(default 20). Files with errors produce no output.
+
+With --format=binary the parse trees are written in a compact binary format
+(*S.jpt) instead, read by ParseTreeReader.hh. With --check nothing is written:
+the files are only checked for syntax errors, which are printed, and the exit
+status is 1 if any file has errors. No output is built in this mode.
+
+With --stats=FILE the run is instrumented (see Part_5/Stats.hh) and a JSON
+summary is written to FILE, or printed with --stats. It counts tokens lexed,
+regex calls, matchPeek calls and the bytes of output built, and times the
+phases 'lex', 'parse' (which builds the output) and 'write'. The parser has no
+symbol table, so there are no symbol lookups to count.
+
+Command line:  Parser.hh [sourceDir] [--max-errors=N] [--format=xml|binary] [--check] [--stats[=FILE]]
 */
 function main()
 {
-    echo "This script takes Jack source and outputs the XML parse.\n";
-    $srcDir = readline('Enter the source directory:  ');
+    // The source directory may also be given on the command line (used by the benchmarks)
+    $args = [];
+    $checkOnly = false;
+    $statsFile = '';
+    foreach (array_slice($GLOBALS['argv'], 1) as $arg) {
+        if ($arg === '--stats' || substr($arg, 0, 8) === '--stats=') {
+            Stats::$enabled = true;
+            $statsFile = (string)substr($arg, 8);
+        }
+        else if (substr($arg, 0, 13) === '--max-errors=')
+            $GLOBALS['maxErrors'] = max(1, (int)substr($arg, 13));
+        else if ($arg === '--check')
+            $checkOnly = true;
+        else if (substr($arg, 0, 9) === '--format=')
+            $GLOBALS['outputFormat'] = substr($arg, 9);
+        else
+            $args[] = $arg;
+    }
+    if ($checkOnly)
+        $GLOBALS['outputFormat'] = 'none';
+    if (!in_array($GLOBALS['outputFormat'], ['xml', 'binary', 'none'])) {
+        echo "Unknown output format '" . $GLOBALS['outputFormat'] . "'\n";
+        exit(1);
+    }
+    if (!$checkOnly)
+        echo "This script takes Jack source and outputs the XML parse.\n";
+    $srcDir = (count($args) > 0) ? $args[0] : readline('Enter the source directory:  ');
     $srcDir = getcwd() . '/' . trim($srcDir); // getcwd == 'get current working directory'
     $paths = scandir($srcDir);
     array_splice($paths, 0, 2); // the first two elements in the array are: '.', '..' - these are unneeded
+    $numFiles = 0;
+    $numFailed = 0;
     foreach($paths as $key) {
         if (pathinfo($key, PATHINFO_EXTENSION) !== 'jack') // checks if the file has extension other than 'jack'. If so, skip over
             continue;
-        echo "\nParsing " . $key . "...\n";
+        if (!$checkOnly)
+            echo "\nParsing " . $key . "...\n";
+        $numFiles++;
+        if (Stats::$enabled)
+            Stats::startFile($key);
         $contents = file_get_contents("$srcDir/$key");
+        $start = microtime(true);
+        tokenize($contents);
+        if (Stats::$enabled) {
+            Stats::time('lex', $start);
+            Stats::count('regex calls');
+            Stats::count('tokens lexed', count($GLOBALS['tokTypes']));
+        }
+        $start = microtime(true);
+        startOutput();
+        $GLOBALS['diagnostics'] = [];
         try {
             // We start the recursive decent from the starting variable 'class'
-            file_put_contents("$srcDir/" . strtok($key, '.') . 'S.xml', parseClass($contents));
+            parseClass();
+        }
+        catch(SourceError $e) {
+            report($e);
         }
-        catch(Exception $e) {
-            echo $e->getMessage() , "\n";
+        catch(ErrorLimitReached $e) {
+            $GLOBALS['diagnostics'][] = 'too many errors, giving up on this file';
+        }
+        if (Stats::$enabled)
+            Stats::time('parse', $start);
+
+        if (count($GLOBALS['diagnostics']) > 0) {
+            foreach ($GLOBALS['diagnostics'] as $diagnostic)
+                echo "$key:$diagnostic\n";
+            $numFailed++;
+            continue;
+        }
+        if (!$checkOnly) {
+            $start = microtime(true);
+            $output = finishOutput();
+            $extension = ($GLOBALS['outputFormat'] === 'binary') ? 'jpt' : 'xml';
+            file_put_contents("$srcDir/" . strtok($key, '.') . "S.$extension", $output);
+            if (Stats::$enabled) {
+                Stats::count('bytes concatenated', strlen($output));
+                Stats::time('write', $start);
+            }
         }
     }
+
+    if (Stats::$enabled) {
+        Stats::endFile();
+        Stats::write($statsFile);
+    }
+
+    if ($checkOnly) {
+        echo "$numFiles file(s) checked, $numFailed with errors\n";
+        exit(($numFailed > 0) ? 1 : 0);
+    }
+}
+
+/*
+Every token of the language, and the whitespace and comments between them, as
+alternatives of a single pattern. The groups are, in order: integerConstant,
+stringConstant, symbol, keyword, identifier, and any other character (an error).
+The order of the alternatives is important.
+*/
+const TOKEN_PATTERN = '/[ \t\n\r\0\x0B]+|\/\/[^\n]*|\/\*\*.*?(?:\*\/|\z)|(\d+)|("[^"\n]*")|([{}()[\].,;+\-*\/&|<>=~])'
+    . '|(class|constructor|function|method|field|static|var|int|char|boolean|void|true|false|null|this|let|do|if|else|while|return)'
+    . '|([a-zA-Z_]+\w*)|(.)/s';
+$tokenTypes = [1 => 'integerConstant', 2 => 'stringConstant', 3 => 'symbol', 4 => 'keyword', 5 => 'identifier', 6 => 'invalid'];
+
+// What the parse functions build: 'xml', 'binary' or 'none' (in --check mode)
+$outputFormat = 'xml';
+
+// The output of the file being parsed, the names of the open nodes, and for the
+// binary format the ids of the strings defined so far
+$output = '';
+$openNodes = [];
+$stringIds = [];
+
+// The source of the file being parsed, and where in it the tokenizer last looked for a token
+$source = '';
+$tokenOffset = 0;
+
+// The tokens of the file being parsed, as parallel arrays, and the index of the next one
+$tokTypes = [];
+$tokValues = [];
+$tokOffsets = [];
+$tokIndex = 0;
+
+// Formatted errors of the file being parsed, and how many are reported before giving up on it
+$diagnostics = [];
+$maxErrors = 20;
+
+// An error at a byte offset of the source.
+class SourceError extends Exception {
+    public int $offset;
+
+    public function __construct(string $message, int $offset)
+    {
+        parent::__construct($message);
+        $this->offset = $offset;
+    }
 }
 
-// Regular expressions defining language constructs. The order of expressions in this array is important.
-$regExps = [
-    'integerConstant' => '/\d+/',
-    'stringConstant' => '/"[^"\n]*"/',
-    'symbol' => '/{|}|\(|\)|\[|\]|\.|,|;|,|\+|-|\*|\/|&|\||<|>|=|~/',
-    'keyword' => '/class|constructor|function|method|field|static|var|int|char|boolean|void|true|false|null|this|let|do|if|else|while|return/',
-    'identifier' => '/[a-zA-Z_]+\w*/'
-];
+// Thrown once a file has reported $maxErrors errors.
+class ErrorLimitReached extends Exception {}
 
-function parseErr(string $str, string $errMsg) : void
+// Throws a SourceError where the tokenizer is.
+function parseErr(string $errMsg) : void
 {
-    throw new Exception('Parse Error:  ' . $errMsg . "\nString remaining:\n" . $str);
+    throw new SourceError('Parse Error: ' . $errMsg, $GLOBALS['tokenOffset']);
 }
 
-/*
-Description:
-This function returns the next token to be processed out of the input.
+// Records an error as 'line:column: message'.
+function report(SourceError $e) : void
+{
+    $before = substr($GLOBALS['source'], 0, $e->offset);
+    $line = substr_count($before, "\n") + 1;
+    $column = $e->offset - (int)strrpos("\n" . $before, "\n") + 1;
+    $GLOBALS['diagnostics'][] = "$line:$column: " . $e->getMessage();
+    if (count($GLOBALS['diagnostics']) >= $GLOBALS['maxErrors'])
+        throw new ErrorLimitReached();
+}
 
-Parameters: (All parameters are passed by-reference)
-in str = The remaining code yet to be parsed. This function changes the original string object.
-out type = The type of the token parsed is placed in this variable.
-out value = The value of the token parsed is placed in this variable.
+/*
+Panic-mode recovery: skips tokens up to and including the next ';', or up to
+(not including) the next '}', so that parsing can go on after an error.
+Characters that are not part of any token are skipped too.
 */
-function getNextTok(string &$str, ?string &$type, ?string &$value) : bool
+function recover() : void
 {
-    $str = ltrim($str);
-    if (strlen($str) === 0) return false;
-
-    if (substr($str, 0, 2) === '//') {
-        if (($pos = strpos($str, "\n")) !== false) {
-            $str = substr($str, $pos + 1);
-            return getNextTok($str, $type, $value);
-        }
-        else {
-            return false;
+    $count = count($GLOBALS['tokTypes']);
+    for ($i = $GLOBALS['tokIndex']; $i < $count; $i++) {
+        $value = $GLOBALS['tokValues'][$i];
+        if ($value === '}' && $GLOBALS['tokTypes'][$i] === 'symbol')
+            break;
+        if ($value === ';' && $GLOBALS['tokTypes'][$i] === 'symbol') {
+            $i++;
+            break;
         }
     }
+    $GLOBALS['tokIndex'] = $i;
+}
 
-    if (substr($str, 0, 3) === '/**') {
-        if (($pos = strpos($str, '*/')) !== false) {
-            $str = substr($str, $pos + 2);
-            return getNextTok($str, $type, $value);
-        }
-        else {
-            return false;
-        }
+/*
+Description:
+Splits the source of a file into its tokens in a single pass, dropping the
+whitespace and comments. The parse functions then work on the token arrays.
+*/
+function tokenize(string $source) : void
+{
+    $GLOBALS['source'] = $source;
+    $GLOBALS['tokTypes'] = [];
+    $GLOBALS['tokValues'] = [];
+    $GLOBALS['tokOffsets'] = [];
+    $GLOBALS['tokIndex'] = 0;
+    preg_match_all(TOKEN_PATTERN, $source, $matches, PREG_SET_ORDER | PREG_OFFSET_CAPTURE);
+    foreach ($matches as $match) {
+        $group = count($match) - 1; // groups after the one that matched are left out
+        if ($group === 0)
+            continue; // whitespace or a comment
+        $GLOBALS['tokTypes'][] = $GLOBALS['tokenTypes'][$group];
+        $GLOBALS['tokValues'][] = $match[0][0];
+        $GLOBALS['tokOffsets'][] = $match[0][1];
     }
+}
 
-    foreach($GLOBALS['regExps'] as $key => $regex) {
-        if (preg_match($regex, $str, $match, PREG_OFFSET_CAPTURE) && $match[0][1] === 0) {
-            $type = $key;
-            $value = $match[0][0];
-            $str = substr($str, strlen($value));
-            return true;
-        }
-    }
+/*
+Description:
+Looks at the next token without consuming it.
 
-    // If function has not returned by here, then input string was invalid.
-    parseErr($str, 'Could not parse next token');
+Parameters:
+out type = The type of the token is placed in this variable.
+out value = The value of the token is placed in this variable.
+
+Return Value:
+Whether there is a next token (false at the end of the file).
+*/
+function peekTok(?string &$type, ?string &$value) : bool
+{
+    $i = $GLOBALS['tokIndex'];
+    if ($i >= count($GLOBALS['tokTypes'])) {
+        $GLOBALS['tokenOffset'] = strlen($GLOBALS['source']);
+        return false;
+    }
+    $GLOBALS['tokenOffset'] = $GLOBALS['tokOffsets'][$i];
+    $type = $GLOBALS['tokTypes'][$i];
+    $value = $GLOBALS['tokValues'][$i];
+    if ($type === 'invalid')
+        parseErr("Unexpected character '$value'");
+    return true;
 }
 
 // Returns the token at a look ahead of one. (Not the current token, but the one after.)
-function lookAheadOne(string $str) : string
+function lookAheadOne() : string
 {
-    getNextTok($str, $type, $val);
-    getNextTok($str, $type, $val);
-    return $val;
+    $i = $GLOBALS['tokIndex'] + 1;
+    return ($i < count($GLOBALS['tokValues'])) ? $GLOBALS['tokValues'][$i] : '';
 }
 
 /*
 Checks to see if the token next in line matches either of the values or types
-given. It also returns the appropriate XML parse string.
+given, consumes it and adds it to the output. Returns its value.
 */
-function match(string &$str, $vals, $types = []) : string
+function match($vals, $types = []) : string
 {
-    if (!getNextTok($str, $type, $val))
-        parseErr($str, 'Unexpected end of file reached');
+    if (!peekTok($type, $val))
+        parseErr('Unexpected end of file reached');
     if (!in_array($val, $vals) && !in_array($type, $types)){
-        echo "Value:  $val\nValues:  " . print_r($vals, true);
-        echo "\nType:  $type\nTypes:  " . print_r($types, true);
-        parseErr($str, 'Unexpected token');
+        parseErr("Unexpected '$val', expected " . implode(' or ', array_merge($vals, $types)));
     }
-    return printTerminal($type, $val);
+    if ($GLOBALS['outputFormat'] !== 'none')
+        emitToken($type, $val, $GLOBALS['tokOffsets'][$GLOBALS['tokIndex']]);
+    $GLOBALS['tokIndex']++;
+    return $val;
 }
 
 /*
 Checks to see if the token next in line matches either the values or types
-given without advancing the input string.
+given without advancing the input.
 */
-function matchPeek(string $str, $vals, $types = []) : bool
+function matchPeek($vals, $types = []) : bool
 {
-    if (getNextTok($str, $type, $val)) {
-        if (in_array($val, $vals) || in_array($type, $types)) {
-            return true;
-        }
-    }
-    return false;
+    if (Stats::$enabled)
+        Stats::count('matchPeek calls');
+    return peekTok($type, $val) && (in_array($val, $vals) || in_array($type, $types));
 }
 
 // Takes a token and returns the XML to print.
@@ -146,292 +310,350 @@ function printTerminal(string $type, string $value) : string
     return $retString;
 }
 
-// Appends a tab character the beginning of each line of a multiline string.
-function indent($str) : string
+/*
+Output: the parse functions report the nodes of the tree as they enter and
+leave them, and match() reports every token. The tree is written as XML, or in
+the binary format described in ParseTreeReader.hh.
+*/
+
+function startOutput() : void
+{
+    $GLOBALS['output'] = ($GLOBALS['outputFormat'] === 'binary') ? ParseTreeReader::MAGIC : '';
+    $GLOBALS['openNodes'] = [];
+    $GLOBALS['stringIds'] = [];
+}
+
+function finishOutput() : string
 {
-    return "\t" . rtrim(str_replace("\n", "\n\t", $str), "\t");
+    if ($GLOBALS['outputFormat'] === 'binary')
+        $GLOBALS['output'] .= chr(ParseTreeReader::END);
+    return $GLOBALS['output'];
 }
 
-function parseClass(string &$str) : string
+function beginNode(string $name) : void
 {
-    $retString = "<class>\n";
-    $retString .= "\t" . match($str, ['class']);
-    $retString .= "\t" . match($str, [], ['identifier']);
-    $retString .= "\t" . match($str, ['{']);
-    while (matchPeek($str, ['static', 'field'])) {
-        $retString .= indent(parseClassVarDec($str));
+    if ($GLOBALS['outputFormat'] === 'xml') {
+        $GLOBALS['output'] .= str_repeat("\t", count($GLOBALS['openNodes'])) . "<$name>\n";
     }
-    while (matchPeek($str, ['constructor', 'function', 'method'])) {
-        $retString .= indent(parseSubroutineDec($str));
+    else if ($GLOBALS['outputFormat'] === 'binary') {
+        $id = stringId($name);
+        $GLOBALS['output'] .= chr(ParseTreeReader::BEGIN) . varint($id);
     }
-    $retString .= "\t" . match($str, ['}']);
-    $retString .= "</class>\n";
-
-    return $retString;
+    $GLOBALS['openNodes'][] = $name;
 }
 
-function parseClassVarDec(string &$str) : string
+function endNode() : void
 {
-    $retString = "<classVarDec>\n";
-    $retString .= "\t" . match($str, ['static', 'field']);
-    $retString .= "\t" . match($str, ['int', 'char', 'boolean'], ['identifier']);
-    $retString .= "\t" . match($str, [], ['identifier']);
-    while (matchPeek($str, [','])) {
-        $retString .= "\t" . match($str, [',']);
-        $retString .= "\t" . match($str, [], ['identifier']);
+    $name = array_pop($GLOBALS['openNodes']);
+    if ($GLOBALS['outputFormat'] === 'xml') {
+        $GLOBALS['output'] .= str_repeat("\t", count($GLOBALS['openNodes'])) . "</$name>\n";
     }
-    $retString .= "\t" . match($str, [';']);
-    $retString .= "</classVarDec>\n";
+    else if ($GLOBALS['outputFormat'] === 'binary') {
+        $GLOBALS['output'] .= chr(ParseTreeReader::CLOSE);
+    }
+}
 
-    return $retString;
+function emitToken(string $type, string $value, int $offset) : void
+{
+    if ($GLOBALS['outputFormat'] === 'xml') {
+        $GLOBALS['output'] .= str_repeat("\t", count($GLOBALS['openNodes'])) . printTerminal($type, $value);
+        return;
+    }
+    if ($type === 'stringConstant')
+        $value = trim($value, '"');
+    $id = stringId($value);
+    $GLOBALS['output'] .= chr(ParseTreeReader::TOKEN) . chr(array_search($type, ParseTreeReader::TOKEN_TYPES))
+        . varint($id) . varint($offset);
 }
 
-function parseSubroutineDec(string &$str) : string
+// Returns the id of a string in the binary output, defining it first if it is new.
+function stringId(string $str) : int
 {
-    $retString = "<subroutineDec>\n";
-    $retString .= "\t" . match($str, ['constructor', 'function', 'method']);
-    $retString .= "\t" . match($str, ['int', 'char', 'boolean', 'void'], ['identifier']);
-    $retString .= "\t" . match($str, [], ['identifier']);
-    $retString .= "\t" . match($str, ['(']);
-    $retString .= indent(parseParameterList($str));
-    $retString .= "\t" . match($str, [')']);
-    $retString .= indent(parseSubroutineBody($str));
-    $retString .= "</subroutineDec>\n";
+    if (!isset($GLOBALS['stringIds'][$str])) {
+        $GLOBALS['stringIds'][$str] = count($GLOBALS['stringIds']);
+        $GLOBALS['output'] .= chr(ParseTreeReader::STRING) . varint(strlen($str)) . $str;
+    }
+    return $GLOBALS['stringIds'][$str];
+}
 
-    return $retString;
+// Encodes an unsigned number as an LEB128 varint.
+function varint(int $n) : string
+{
+    $bytes = '';
+    while ($n >= 0x80) {
+        $bytes .= chr(($n & 0x7F) | 0x80);
+        $n >>= 7;
+    }
+    return $bytes . chr($n);
 }
 
-function parseParameterList(string &$str) : string
+function parseClass() : void
 {
-    $retString = "<parameterList>\n";
-    if (matchPeek($str, ['int', 'char', 'boolean'], ['identifier'])) {
-        $retString .= "\t" . match($str, ['int', 'char', 'boolean'], ['identifier']);
-        $retString .= "\t" . match($str, [], ['identifier']);
-        while (matchPeek($str, [','])) {
-            $retString .= "\t" . match($str, [',']);
-            $retString .= "\t" . match($str, ['int', 'char', 'boolean'], ['identifier']);
-            $retString .= "\t" . match($str, [], ['identifier']);
+    beginNode('class');
+    match(['class']);
+    match([], ['identifier']);
+    match(['{']);
+    while (matchPeek(['static', 'field'])) {
+        try {
+            parseClassVarDec();
+        }
+        catch(SourceError $e) {
+            report($e);
+            recover();
         }
     }
-    $retString .= "</parameterList>\n";
-
-    return $retString;
+    while (matchPeek(['constructor', 'function', 'method'])) {
+        parseSubroutineDec();
+    }
+    match(['}']);
+    endNode();
 }
 
-function parseSubroutineBody(string &$str) : string
+function parseClassVarDec() : void
 {
-    $retString = "<subroutineBody>\n";
-    $retString .= "\t" . match($str, ['{']);
-    while (matchPeek($str, ['var'])) {
-        $retString .= indent(parseVarDec($str));
+    beginNode('classVarDec');
+    match(['static', 'field']);
+    match(['int', 'char', 'boolean'], ['identifier']);
+    match([], ['identifier']);
+    while (matchPeek([','])) {
+        match([',']);
+        match([], ['identifier']);
     }
-    $retString .= indent(parseStatements($str));
-    $retString .= "\t" . match($str, ['}']);
-    $retString .= "</subroutineBody>\n";
+    match([';']);
+    endNode();
+}
 
-    return $retString;
+function parseSubroutineDec() : void
+{
+    beginNode('subroutineDec');
+    match(['constructor', 'function', 'method']);
+    match(['int', 'char', 'boolean', 'void'], ['identifier']);
+    match([], ['identifier']);
+    match(['(']);
+    parseParameterList();
+    match([')']);
+    parseSubroutineBody();
+    endNode();
 }
 
-function parseVarDec(string &$str) : string
+function parseParameterList() : void
 {
-    $retString = "<varDec>\n";
-    $retString .= "\t" . match($str, ['var']);
-    $retString .= "\t" . match($str, ['int', 'char', 'boolean'], ['identifier']);
-    $retString .= "\t" . match($str, [], ['identifier']);
-    while (matchPeek($str, [','])) {
-        $retString .= "\t" . match($str, [',']);
-        $retString .= "\t" . match($str, [], ['identifier']);
+    beginNode('parameterList');
+    if (matchPeek(['int', 'char', 'boolean'], ['identifier'])) {
+        match(['int', 'char', 'boolean'], ['identifier']);
+        match([], ['identifier']);
+        while (matchPeek([','])) {
+            match([',']);
+            match(['int', 'char', 'boolean'], ['identifier']);
+            match([], ['identifier']);
+        }
     }
-    $retString .= "\t" . match($str, [';']);
-    $retString .= "</varDec>\n";
+    endNode();
+}
 
-    return $retString;
+function parseSubroutineBody() : void
+{
+    beginNode('subroutineBody');
+    match(['{']);
+    while (matchPeek(['var'])) {
+        try {
+            parseVarDec();
+        }
+        catch(SourceError $e) {
+            report($e);
+            recover();
+        }
+    }
+    parseStatements();
+    match(['}']);
+    endNode();
 }
 
-function parseStatements(string &$str) : string
+function parseVarDec() : void
 {
-    $retString = "<statements>\n";
-    while (matchPeek($str, ['let', 'if', 'while', 'do', 'return'])) {
-        if (matchPeek($str, ['let']))
-            $retString .= indent(parseLetStatement($str));
+    beginNode('varDec');
+    match(['var']);
+    match(['int', 'char', 'boolean'], ['identifier']);
+    match([], ['identifier']);
+    while (matchPeek([','])) {
+        match([',']);
+        match([], ['identifier']);
+    }
+    match([';']);
+    endNode();
+}
 
-        else if (matchPeek($str, ['if']))
-            $retString .= indent(parseIfStatement($str));
+function parseStatements() : void
+{
+    beginNode('statements');
+    while (matchPeek(['let', 'if', 'while', 'do', 'return'])) {
+        try {
+            if (matchPeek(['let']))
+                parseLetStatement();
 
-        else if (matchPeek($str, ['while']))
-            $retString .= indent(parseWhileStatement($str));
+            else if (matchPeek(['if']))
+                parseIfStatement();
 
-        else if (matchPeek($str, ['do']))
-            $retString .= indent(parseDoStatement($str));
+            else if (matchPeek(['while']))
+                parseWhileStatement();
 
-        else if (matchPeek($str, ['return']))
-            $retString .= indent(parseReturnStatement($str));
-    }
-    $retString .= "</statements>\n";
+            else if (matchPeek(['do']))
+                parseDoStatement();
 
-    return $retString;
+            else if (matchPeek(['return']))
+                parseReturnStatement();
+        }
+        catch(SourceError $e) {
+            report($e);
+            recover();
+        }
+    }
+    endNode();
 }
 
-function parseLetStatement(string &$str) : string
+function parseLetStatement() : void
 {
-    $retString = "<letStatement>\n";
-    $retString .= "\t" . match($str, ['let']);
-    $retString .= "\t" . match($str, [], ['identifier']);
-    if (matchPeek($str, ['['])) {
-        $retString .= "\t" . match($str, ['[']);
-        $retString .= indent(parseExpression($str));
-        $retString .= "\t" . match($str, [']']);
+    beginNode('letStatement');
+    match(['let']);
+    match([], ['identifier']);
+    if (matchPeek(['['])) {
+        match(['[']);
+        parseExpression();
+        match([']']);
     }
-    $retString .= "\t" . match($str, ['=']);
-    $retString .= indent(parseExpression($str));
-    $retString .= "\t" . match($str, [';']);
-    $retString .= "</letStatement>\n";
-
-    return $retString;
+    match(['=']);
+    parseExpression();
+    match([';']);
+    endNode();
 }
 
-function parseIfStatement(string &$str) : string
+function parseIfStatement() : void
 {
-    $retString = "<ifStatement>\n";
-    $retString .= "\t" . match($str, ['if']);
-    $retString .= "\t" . match($str, ['(']);
-    $retString .= indent(parseExpression($str));
-    $retString .= "\t" . match($str, [')']);
-    $retString .= "\t" . match($str, ['{']);
-    $retString .= indent(parseStatements($str));
-    $retString .= "\t" . match($str, ['}']);
-    if (matchPeek($str, ['else'])) {
-        $retString .= "\t" . match($str, ['else']);
-        $retString .= "\t" . match($str, ['{']);
-        $retString .= indent(parseStatements($str));
-        $retString .= "\t" . match($str, ['}']);
+    beginNode('ifStatement');
+    match(['if']);
+    match(['(']);
+    parseExpression();
+    match([')']);
+    match(['{']);
+    parseStatements();
+    match(['}']);
+    if (matchPeek(['else'])) {
+        match(['else']);
+        match(['{']);
+        parseStatements();
+        match(['}']);
     }
-    $retString .= "</ifStatement>\n";
-
-    return $retString;
+    endNode();
 }
 
-function parseWhileStatement(string &$str) : string
+function parseWhileStatement() : void
 {
-    $retString = "<whileStatement>\n";
-    $retString .= "\t" . match($str, ['while']);
-    $retString .= "\t" . match($str, ['(']);
-    $retString .= indent(parseExpression($str));
-    $retString .= "\t" . match($str, [')']);
-    $retString .= "\t" . match($str, ['{']);
-    $retString .= indent(parseStatements($str));
-    $retString .= "\t" . match($str, ['}']);
-    $retString .= "</whileStatement>\n";
-
-    return $retString;
+    beginNode('whileStatement');
+    match(['while']);
+    match(['(']);
+    parseExpression();
+    match([')']);
+    match(['{']);
+    parseStatements();
+    match(['}']);
+    endNode();
 }
 
-function parseDoStatement(string &$str) : string
+function parseDoStatement() : void
 {
-    $retString = "<doStatement>\n";
-    $retString .= "\t" . match($str, ['do']);
-    $retString .= indent(parseSubroutineCall($str));
-    $retString .= "\t" . match($str, [';']);
-    $retString .= "</doStatement>\n";
-
-    return $retString;
+    beginNode('doStatement');
+    match(['do']);
+    parseSubroutineCall();
+    match([';']);
+    endNode();
 }
 
-function parseReturnStatement(string &$str) : string
+function parseReturnStatement() : void
 {
-    $retString = "<returnStatement>\n";
-    $retString .= "\t" . match($str, ['return']);
-    if (!matchPeek($str, [';'])) {
-        $retString .= indent(parseExpression($str));
+    beginNode('returnStatement');
+    match(['return']);
+    if (!matchPeek([';'])) {
+        parseExpression();
     }
-    $retString .= "\t" . match($str, [';']);
-    $retString .= "</returnStatement>\n";
-
-    return $retString;
+    match([';']);
+    endNode();
 }
 
-function parseExpression(string &$str) : string
+function parseExpression() : void
 {
-    $retString = "<expression>\n";
-    $retString .= indent(parseTerm($str));
-    while (matchPeek($str, ['+', '-', '*', '/', '&', '|', '<', '>','='])) {
-        $retString .= "\t" . match($str, ['+', '-', '*', '/', '&', '|', '<', '>', '=']);
-        $retString .= indent(parseTerm($str));
+    beginNode('expression');
+    parseTerm();
+    while (matchPeek(['+', '-', '*', '/', '&', '|', '<', '>','='])) {
+        match(['+', '-', '*', '/', '&', '|', '<', '>', '=']);
+        parseTerm();
     }
-    $retString .= "</expression>\n";
-
-    return $retString;
+    endNode();
 }
 
-function parseTerm(string &$str) : string
+function parseTerm() : void
 {
-    $retString = "<term>\n";
+    beginNode('term');
 
-    if (matchPeek($str, [], ['integerConstant'])) {
-        $retString .= "\t" . match($str, [], ['integerConstant']);
+    if (matchPeek([], ['integerConstant'])) {
+        match([], ['integerConstant']);
     }
-    else if (matchPeek($str, [], ['stringConstant'])) {
-        $retString .= "\t" . match($str, [], ['stringConstant']);
+    else if (matchPeek([], ['stringConstant'])) {
+        match([], ['stringConstant']);
     }
-    else if (matchPeek($str, ['true', 'false', 'null', 'this'])) {
-        $retString .= "\t" . match($str, ['true', 'false', 'null', 'this']);
+    else if (matchPeek(['true', 'false', 'null', 'this'])) {
+        match(['true', 'false', 'null', 'this']);
     }
-    else if (matchPeek($str, [], ['identifier'])) {
-        if (lookAheadOne($str) === '(' || lookAheadOne($str) === '.') {
-            $retString .= indent(parseSubroutineCall($str));
+    else if (matchPeek([], ['identifier'])) {
+        if (lookAheadOne() === '(' || lookAheadOne() === '.') {
+            parseSubroutineCall();
         }
         else {
-            $retString .= "\t" . match($str, [], ['identifier']);
-            if (matchPeek($str, ['['])) {
-                $retString .= "\t" . match($str, ['[']);
-                $retString .= indent(parseExpression($str));
-                $retString .= "\t" . match($str, [']']);
+            match([], ['identifier']);
+            if (matchPeek(['['])) {
+                match(['[']);
+                parseExpression();
+                match([']']);
             }
         }
     }
-    else if (matchPeek($str, ['('])) {
-        $retString .= "\t" . match($str, ['(']);
-        $retString .= indent(parseExpression($str));
-        $retString .= "\t" . match($str, [')']);
+    else if (matchPeek(['('])) {
+        match(['(']);
+        parseExpression();
+        match([')']);
     }
-    else if (matchPeek($str, ['-', '~'])) {
-        $retString .= "\t" . match($str, ['-', '~']);
-        $retString .= indent(parseTerm($str));
+    else if (matchPeek(['-', '~'])) {
+        match(['-', '~']);
+        parseTerm();
     }
-    // else { possibly need Exception thrown here }
-
-    $retString .= "</term>\n";
+    else
+        parseErr('Expected a term');
 
-    return $retString;
+    endNode();
 }
 
-function parseSubroutineCall(string &$str) : string
+function parseSubroutineCall() : void
 {
-    $retString = match($str, [], ['identifier']);
-    if (matchPeek($str, ['.'])) {
-        $retString .= match($str, ['.']);
-        $retString .= match($str, [], ['identifier']);
+    match([], ['identifier']);
+    if (matchPeek(['.'])) {
+        match(['.']);
+        match([], ['identifier']);
     }
-    $retString .= match($str, ['(']);
-    $retString .= parseExpressionList($str);
-    $retString .= match($str, [')']);
-
-    return $retString;
+    match(['(']);
+    parseExpressionList();
+    match([')']);
 }
 
-function parseExpressionList(string &$str) : string
+function parseExpressionList() : void
 {
-    $retString = "<expressionList>\n";
-    if (!matchPeek($str, [')'])) {
-        $retString .= indent(parseExpression($str));
-        while (matchPeek($str, [','])) {
-            $retString .= "\t" . match($str, [',']);
-            $retString .= indent(parseExpression($str));
+    beginNode('expressionList');
+    if (!matchPeek([')'])) {
+        parseExpression();
+        while (matchPeek([','])) {
+            match([',']);
+            parseExpression();
         }
     }
-    $retString .= "</expressionList>\n";
-
-    return $retString;
+    endNode();
 }
 
 main();
@@ -0,0 +1,192 @@
+<?hh //strict
+
+/*
+	An index of every class in the program and its subroutines, built by a quick
+	first pass over all of the .jack files before any of them is compiled. For
+	every subroutine it records a packed [kind, numParams] record, where kind is
+	'constructor', 'function' or 'method'.
+
+	The index is saved to disk with serialize() together with a hash of each
+	source file, so files that did not change are not scanned again. Each file
+	also records the identifiers it mentions, so that the output of a class can be
+	keyed on just the declarations it can use (see hashFor), and the calls each
+	of its subroutines makes (see initRunsOnce). The entries
+	are also kept in the object, so building the same index again (in --watch
+	mode) only reads the disk for the files themselves.
+*/
+class ClassIndex {
+	const int KIND = 0;
+	const int NUM_PARAMS = 1;
+
+	// Changes whenever scan() returns something new, so older saved entries are not reused
+	const string FORMAT = '3';
+
+	// class name => subroutine name => [kind, numParams]
+	private array<string, array<string, array>> $classes;
+	// file name => [hash of its source, scan() of it], from the last build
+	private array<string, array> $entries;
+
+	public function __construct()
+	{
+		$this->classes = [];
+		$this->entries = [];
+	}
+
+	/*
+		Indexes the given .jack files of $srcDir, replacing what was indexed before.
+		Entries of the previous build of this index, or else saved in $indexFile,
+		are reused for files whose contents did not change, and the updated index
+		is saved back. An empty $indexFile disables saving.
+	*/
+	public function build(string $srcDir, array<string> $files, string $indexFile) : void
+	{
+		$saved = $this->entries;
+		if (count($saved) === 0 && $indexFile !== '' && file_exists($indexFile))
+			$saved = unserialize(file_get_contents($indexFile));
+
+		$this->classes = [];
+		$entries = [];
+		foreach ($files as $file) {
+			$contents = file_get_contents("$srcDir/$file");
+			$hash = sha1(self::FORMAT . "\0" . $contents);
+			if (is_array($saved) && isset($saved[$file]) && $saved[$file][0] === $hash)
+				$entries[$file] = $saved[$file];
+			else
+				$entries[$file] = [$hash, self::scan($contents)];
+
+			$declarations = $entries[$file][1];
+			if ($declarations[0] !== '')
+				$this->classes[$declarations[0]] = $declarations[1];
+		}
+		$this->entries = $entries;
+
+		if ($indexFile !== '') {
+			if (!is_dir(dirname($indexFile)))
+				mkdir(dirname($indexFile), 0777, true);
+			file_put_contents($indexFile, serialize($entries));
+		}
+	}
+
+	/*
+		Finds the class name and subroutine declarations of a Jack source without
+		parsing it: comments and strings are removed and the declarations are
+		matched directly. Comments and strings are matched by a single pattern, so
+		a '//' inside a string or a '"' inside a comment is not taken for the other.
+
+		Calls are recognized as a name followed by '(', and are recorded as
+		'Class.sub', or 'var.sub' for a method call on a variable; 'sub()' is a
+		call in the class itself.
+
+		Return Value:
+		[className, [subName => [kind, numParams], ...], [identifier => true, ...],
+		 [subName => ['Class.sub', ...], ...]]
+	*/
+	public static function scan(string $source) : array
+	{
+		$source = preg_replace_callback('#"[^"\n]*"|//[^\n]*|/\*.*?\*/#s',
+			(array<string> $match) ==> ($match[0][0] === '"') ? '""' : ' ', $source);
+
+		$className = '';
+		if (preg_match('/\bclass\s+([A-Za-z_]\w*)/', $source, $match))
+			$className = $match[1];
+
+		$subs = [];
+		preg_match_all('/\b(constructor|function|method)\s+[A-Za-z_]\w*\s+([A-Za-z_]\w*)\s*\(([^)]*)\)/',
+			$source, $matches, PREG_SET_ORDER);
+		foreach ($matches as $match) {
+			$params = trim($match[3]);
+			$subs[$match[2]] = [$match[1], ($params === '') ? 0 : substr_count($params, ',') + 1];
+		}
+
+		$calls = [];
+		$current = '';
+		preg_match_all('/\b(?:constructor|function|method)\s+[A-Za-z_]\w*\s+([A-Za-z_]\w*)\s*\(|'
+			. '(?:\b([A-Za-z_]\w*)\s*\.\s*)?\b([A-Za-z_]\w*)\s*\(/', $source, $matches, PREG_SET_ORDER);
+		foreach ($matches as $match) {
+			if ($match[1] !== '') {
+				$current = $match[1];
+				continue;
+			}
+			if ($match[2] === '' && in_array($match[3], ['if', 'while', 'return']))
+				continue;
+			$calls[$current][] = (($match[2] !== '') ? $match[2] : $className) . '.' . $match[3];
+		}
+
+		preg_match_all('/[A-Za-z_]\w*/', $source, $words);
+		return [$className, $subs, array_fill_keys($words[0], true), $calls];
+	}
+
+	public function hasClass(string $className) : bool
+	{
+		return isset($this->classes[$className]);
+	}
+
+	public function hasConstructor(string $className) : bool
+	{
+		if (!isset($this->classes[$className]))
+			return false;
+		foreach ($this->classes[$className] as $decl) {
+			if ($decl[self::KIND] === 'constructor')
+				return true;
+		}
+		return false;
+	}
+
+	// Returns the [kind, numParams] record of a subroutine, or null if it is not indexed.
+	public function lookup(string $className, string $subName) : ?array
+	{
+		if (!isset($this->classes[$className][$subName]))
+			return null;
+		return $this->classes[$className][$subName];
+	}
+
+	/*
+		A hash of the declarations the class in $file can use, for keys of cached
+		output that depends on the index: of every indexed class the file mentions,
+		the subroutines whose names it mentions. A call, whether 'Class.sub()',
+		'var.sub()' (the variable's type is declared in the file too) or 'sub()',
+		names both, so changing a declaration only changes the keys of the classes
+		that may call it.
+	*/
+	public function hashFor(string $file) : string
+	{
+		$words = $this->entries[$file][1][2];
+		$used = [];
+		foreach ($words as $word => $_) {
+			if (isset($this->classes[$word]))
+				$used[$word] = array_intersect_key($this->classes[$word], $words);
+		}
+		ksort($used);
+		$className = $this->entries[$file][1][0];
+		// see --static-image in Compiler.hh
+		$used[''] = [$this->initRunsOnce($className), $this->hasClass('Math')];
+		return sha1(serialize($used));
+	}
+
+	/*
+		Whether the function init of $className runs once, before the rest of the
+		program uses the class: its only call in the indexed files is in Sys.init,
+		which nothing calls. When Sys is not one of the indexed files, e.g. the OS
+		is given as VM code, what Sys.init calls is not known and this is false.
+	*/
+	public function initRunsOnce(string $className) : bool
+	{
+		return $this->callersOf("$className.init") === ['Sys.init'] && count($this->callersOf('Sys.init')) === 0;
+	}
+
+	// The subroutines ('Class.sub') of the indexed files that call $target, once per call.
+	private function callersOf(string $target) : array<string>
+	{
+		$callers = [];
+		foreach ($this->entries as $entry) {
+			list($className, , , $calls) = $entry[1];
+			foreach ($calls as $subName => $targets) {
+				foreach ($targets as $called) {
+					if ($called === $target)
+						$callers[] = "$className.$subName";
+				}
+			}
+		}
+		return $callers;
+	}
+}
@@ -0,0 +1,73 @@
+<?hh //decl
+
+/*
+	Helpers and constants shared by Compiler.hh and Parts_1_2/Assembler.hh, so that
+	the two tools parse their options, keep their caches, poll for changes (--watch)
+	and lay out the RAM the same way.
+*/
+
+/*
+	The first word of the heap. Compiled code only points THIS and THAT at or above
+	it, and static images only store array elements from here on.
+*/
+const HEAP_BASE = 2048;
+
+/*
+	Splits the command line into positional arguments and '--name=value' / '--flag'
+	options.
+*/
+function parseCommandLine() : array
+{
+	$args = [];
+	$options = [];
+	foreach (array_slice($GLOBALS['argv'], 1) as $arg) {
+		if (substr($arg, 0, 2) === '--') {
+			$parts = explode('=', substr($arg, 2), 2);
+			$options[$parts[0]] = (count($parts) === 2) ? $parts[1] : '';
+		}
+		else
+			$args[] = $arg;
+	}
+
+	return ['args' => $args, 'options' => $options];
+}
+
+/*
+	Returns the cached output stored under $key, or null if there is none.
+	An empty $cacheDir disables the cache.
+*/
+function cacheLoad(string $cacheDir, string $key, string $ext) : ?string
+{
+	if ($cacheDir === '' || !file_exists("$cacheDir/$key.$ext"))
+		return null;
+
+	return file_get_contents("$cacheDir/$key.$ext");
+}
+
+function cacheStore(string $cacheDir, string $key, string $ext, string $output) : void
+{
+	if ($cacheDir === '')
+		return;
+	if (!is_dir($cacheDir))
+		mkdir($cacheDir, 0777, true);
+	// Written under a temporary name first so that a concurrent build never reads a partial entry
+	$tmpName = "$cacheDir/$key." . getmypid() . '.tmp';
+	file_put_contents($tmpName, $output);
+	rename($tmpName, "$cacheDir/$key.$ext");
+}
+
+/*
+	Returns a string that changes whenever a file with the given extension is
+	added to, removed from or modified in $dir. Used to poll for changes.
+*/
+function directorySignature(string $dir, string $extension) : string
+{
+	clearstatcache();
+	$signature = '';
+	foreach (scandir($dir) as $entry) {
+		if (pathinfo($entry, PATHINFO_EXTENSION) === $extension)
+			$signature .= "$entry:" . filemtime("$dir/$entry") . ':' . filesize("$dir/$entry") . "\n";
+	}
+
+	return $signature;
+}
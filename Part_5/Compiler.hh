@@ -4,33 +4,218 @@
 
 
 include('SymbolTable.hh');
+include('ClassIndex.hh');
+include('Stats.hh');
+include('Common.hh');
 
 /*
 	This main is in charge of iterating through all of the .jack files in a source
 	directory and writing the compiled code to respective .vm files.
+
+	Before compiling, every class's declarations are collected into a ClassIndex,
+	which is used to resolve and check subroutine calls between classes.
+
+	Compiled classes are kept in an on-disk cache keyed by a hash of the source,
+	the compiler version, the flags and the declarations of the class index the
+	class can use (see ClassIndex::hashFor), so unchanged classes are not
+	recompiled.
+
+	Errors are reported with the line and column they were found at. After an
+	error in a statement or declaration the compiler skips ahead to the next ';'
+	or '}' and carries on, so a single run reports all of the errors in a file, up
+	to --max-errors of them (default 20). Files with errors produce no output.
+
+	With --stats=FILE the run is instrumented (see Stats.hh) and a JSON summary is
+	written to FILE, or printed with --stats. It counts tokens lexed (lookahead
+	lexes a token again), regex calls, matchPeek calls, symbol lookups and the
+	bytes of VM code of the subroutine bodies, and times the phases 'index',
+	'compile' (parsing and code generation, which are done together), 'lex' (the
+	part of 'compile' spent in the tokenizer) and 'write'.
+
+	With --watch[=MS] the compiler keeps running and polls the directory every MS
+	milliseconds (default 500). When a .jack file changes, the class index is
+	updated from the files that changed and only the classes whose output can
+	differ are compiled again; the index and the outputs are kept in memory
+	between builds.
+
+	With --static-image the leading assignments of a class's 'init' function that
+	store constants are evaluated at compile time instead of compiled (see
+	hoistLet). What they store is written to ClassS.image.json, which the VM
+	translator loads into RAM before the program starts (see --ram-image in
+	Parts_1_2/Assembler.hh). This is only done for init functions that run once,
+	before anything else uses the class's statics: the ones only Sys.init calls
+	(see ClassIndex::initRunsOnce). Other init functions, e.g. ones that are
+	also called to reset the class, are compiled as usual.
+
+	With --pooled-alloc the objects of every class with a constructor come from a
+	free list of the class's own (see poolFunctions): constructors take an object
+	from it and 'do Memory.deAlloc(this)' in the class puts the object back, so
+	short-lived objects seldom reach Memory.alloc and Memory.deAlloc. Objects are
+	still allocated by Memory.alloc when the list is empty, so they may also be
+	freed with Memory.deAlloc from other classes.
+
+	Command line:  Compiler.hh [sourceDir] [--no-cache] [--cache-dir=DIR] [--max-errors=N] [--stats[=FILE]]
+	                           [--watch[=MS]] [--static-image] [--pooled-alloc]
 */
 function main()
 {
 	echo "This script compiles Jack to VM.\n";
-	$srcDir = readline('Enter a source directory:  ');
+	$cmdLine = parseCommandLine();
+	$args = $cmdLine['args'];
+	$options = $cmdLine['options'];
+	// The source directory may also be given on the command line (used by the benchmarks)
+	$srcDir = (count($args) > 0) ? $args[0] : readline('Enter a source directory:  ');
 	$srcDir = getcwd() . '/' . trim($srcDir); // getcwd == 'get current working directory'
+	$cacheDir = array_key_exists('no-cache', $options) ? '' :
+		(array_key_exists('cache-dir', $options) ? $options['cache-dir'] : "$srcDir/.buildcache");
+	if (array_key_exists('max-errors', $options))
+		$GLOBALS['maxErrors'] = max(1, (int)$options['max-errors']);
+	Stats::$enabled = array_key_exists('stats', $options);
+	if (array_key_exists('static-image', $options))
+		$GLOBALS['codegenFlags'][] = 'static-image';
+	if (array_key_exists('pooled-alloc', $options))
+		$GLOBALS['codegenFlags'][] = 'pooled-alloc';
+	$GLOBALS['classIndex'] = new ClassIndex();
+	if (!array_key_exists('watch', $options)) {
+		compileDirectory($srcDir, $cacheDir);
+		if (Stats::$enabled)
+			Stats::write($options['stats']);
+		return;
+	}
+
+	$interval = ($options['watch'] !== '') ? max(50, (int)$options['watch']) : 500;
+	echo "Watching $srcDir for changes, press Ctrl-C to stop.\n";
+	$signature = '';
+	while (true) {
+		$current = directorySignature($srcDir, 'jack');
+		if ($current !== $signature) {
+			$signature = $current;
+			compileDirectory($srcDir, $cacheDir);
+			if (Stats::$enabled)
+				Stats::write($options['stats']);
+			echo "\nWaiting for changes...\n";
+		}
+		usleep($interval * 1000);
+	}
+}
+
+// File name => [cache key, VM code] of the .vm files this process wrote (see --watch)
+$warmOutputs = [];
+
+/*
+	Compiles the .jack files of $srcDir. Files whose .vm output this process
+	already wrote with the same cache key are skipped without a message, so in
+	--watch mode a build only touches the files that changed (or that depend on
+	declarations that changed).
+*/
+function compileDirectory(string $srcDir, string $cacheDir) : void
+{
+	Stats::reset(); // every --watch build gets a summary of its own
 	$paths = scandir($srcDir);
 	array_splice($paths, 0, 2); // the first two elements in the array are: '.', '..' - these are unneeded
+	$jackFiles = [];
 	foreach($paths as $key) {
-		if (pathinfo($key, PATHINFO_EXTENSION) !== 'jack') // checks if the file has extension other than 'jack'. If so, skip over
+		if (pathinfo($key, PATHINFO_EXTENSION) === 'jack') // skips over files with extensions other than 'jack'
+			$jackFiles[] = $key;
+	}
+
+	// First pass: the declarations of every class in the program
+	$start = microtime(true);
+	$GLOBALS['classIndex']->build($srcDir, $jackFiles, ($cacheDir === '') ? '' : "$cacheDir/classindex.ser");
+	if (Stats::$enabled)
+		Stats::time('index', $start);
+
+	foreach($jackFiles as $key) {
+		if (Stats::$enabled)
+			Stats::startFile($key);
+		$contents = file_get_contents("$srcDir/$key");
+		$dstFileName = "$srcDir/" . strtok($key, '.') . 'S.vm';
+		$cacheKey = sha1(COMPILER_VERSION . "\0" . implode(' ', $GLOBALS['codegenFlags']) . "\0"
+			. $GLOBALS['classIndex']->hashFor($key) . "\0" . $contents);
+		$warm = array_key_exists($key, $GLOBALS['warmOutputs']) ? $GLOBALS['warmOutputs'][$key] : null;
+		if ($warm !== null && $warm[0] === $cacheKey) {
+			if (!file_exists($dstFileName))
+				writeOutputs($srcDir, $key, $warm[1], $warm[2]);
 			continue;
+		}
+		$cached = cacheLoad($cacheDir, $cacheKey, 'vm');
+		if ($cached !== null) {
+			echo "\nUsing cached " . $key . "...\n";
+			$image = (string)cacheLoad($cacheDir, $cacheKey, 'image');
+			writeOutputs($srcDir, $key, $cached, $image);
+			$GLOBALS['warmOutputs'][$key] = [$cacheKey, $cached, $image];
+			if (Stats::$enabled)
+				Stats::count('cache hits');
+			continue;
+		}
 		echo "\nCompiling " . $key . "...\n";
-		$contents = file_get_contents("$srcDir/$key");
+		$GLOBALS['source'] = $contents;
+		$GLOBALS['diagnostics'] = [];
+		$retString = '';
+		$start = microtime(true);
 		try {
 			// We start the recursive decent from the grammar's root variable 'class'
-			file_put_contents("$srcDir/" . strtok($key, '.') . 'S.vm', parseClass($contents));
+			$retString = parseClass($contents);
+		}
+		catch(SourceError $e) {
+			report($e);
+		}
+		catch(ErrorLimitReached $e) {
+			$GLOBALS['diagnostics'][] = 'too many errors, giving up on this file';
 		}
-		catch(Exception $e) {
-			echo $e->getMessage() , "\n";
+		if (Stats::$enabled)
+			Stats::time('compile', $start);
+
+		if (count($GLOBALS['diagnostics']) > 0) {
+			foreach ($GLOBALS['diagnostics'] as $diagnostic)
+				echo "$key:$diagnostic\n";
+			unset($GLOBALS['warmOutputs'][$key]);
+			continue;
 		}
+		$start = microtime(true);
+		$image = imageJson($GLOBALS['staticImage']);
+		writeOutputs($srcDir, $key, $retString, $image);
+		cacheStore($cacheDir, $cacheKey, 'image', $image);
+		cacheStore($cacheDir, $cacheKey, 'vm', $retString);
+		$GLOBALS['warmOutputs'][$key] = [$cacheKey, $retString, $image];
+		if (Stats::$enabled)
+			Stats::time('write', $start);
 	}
+
+	if (Stats::$enabled)
+		Stats::endFile();
 }
 
+/*
+	Writes the .vm file of a class, and its static image (see --static-image) if it
+	has one. A stale image of an earlier build is removed. The image is written
+	first, so a translator polling the .vm files (--watch) sees the new image
+	together with the new code.
+*/
+function writeOutputs(string $srcDir, string $key, string $vm, string $image) : void
+{
+	$baseName = "$srcDir/" . strtok($key, '.') . 'S';
+	if ($image !== '')
+		file_put_contents("$baseName.image.json", $image);
+	else if (file_exists("$baseName.image.json"))
+		unlink("$baseName.image.json");
+	file_put_contents("$baseName.vm", $vm);
+}
+
+// The JSON of a class's static image, or '' if it is empty.
+function imageJson(array $image) : string
+{
+	if (count($image['statics']) + count($image['ram']) === 0)
+		return '';
+	return json_encode(['statics' => $image['statics'], 'ram' => $image['ram']], JSON_FORCE_OBJECT) . "\n";
+}
+
+// Bump this whenever the generated code changes, so that stale cache entries are not reused.
+const COMPILER_VERSION = '2016.9';
+
+// Options that change the generated code. They are part of every cache key.
+$codegenFlags = [];
+
 // Regular expressions defining language constructs. The order of expressions in this array is important.
 $regExps = [
 	'integerConstant' => '/\d+/',
@@ -40,9 +225,77 @@ $regExps = [
 	'identifier' => '/[a-zA-Z_]+\w*/'
 ];
 
-function err(string $errType, string $errMsg, string $str) : void
+/******************************
+	DIAGNOSTICS
+******************************/
+
+// The source of the file being compiled, and where in it the tokenizer last looked for a token
+$source = '';
+$tokenOffset = 0;
+// Where the last token consumed by match() starts
+$matchOffset = 0;
+
+// Formatted errors of the file being compiled, and how many are reported before giving up on it
+$diagnostics = [];
+$maxErrors = 20;
+
+// An error at a byte offset of the source.
+class SourceError extends Exception {
+	public int $offset;
+
+	public function __construct(string $message, int $offset)
+	{
+		parent::__construct($message);
+		$this->offset = $offset;
+	}
+}
+
+// Thrown once a file has reported $maxErrors errors.
+class ErrorLimitReached extends Exception {}
+
+/*
+	Throws a SourceError of the given type ('Parse' or 'Compile') at $offset of the
+	source, by default where the tokenizer is.
+*/
+function err(string $errType, string $errMsg, int $offset = -1) : void
+{
+	throw new SourceError("$errType Error: $errMsg", ($offset < 0) ? $GLOBALS['tokenOffset'] : $offset);
+}
+
+// Records an error as 'line:column: message'.
+function report(SourceError $e) : void
+{
+	$before = substr($GLOBALS['source'], 0, $e->offset);
+	$line = substr_count($before, "\n") + 1;
+	$column = $e->offset - (int)strrpos("\n" . $before, "\n") + 1;
+	$GLOBALS['diagnostics'][] = "$line:$column: " . $e->getMessage();
+	if (count($GLOBALS['diagnostics']) >= $GLOBALS['maxErrors'])
+		throw new ErrorLimitReached();
+}
+
+/*
+	Panic-mode recovery: skips tokens up to and including the next ';', or up to
+	(not including) the next '}', so that parsing can go on after an error.
+	Characters that are not part of any token are skipped too.
+*/
+function recover(string &$str) : void
 {
-	throw new Exception("$errType Error:\t" . $errMsg . "\nString remaining:\n" . $str);
+	while (true) {
+		$rest = $str;
+		try {
+			if (!getNextTok($rest, $type, $val))
+				return;
+		}
+		catch(SourceError $e) {
+			$str = substr(ltrim($str), 1);
+			continue;
+		}
+		if ($val === '}')
+			return;
+		$str = $rest;
+		if ($val === ';')
+			return;
+	}
 }
 
 
@@ -53,6 +306,7 @@ function err(string $errType, string $errMsg, string $str) : void
 /*
 	This function parses the value and type of the current token.
 	This function advances the compiler's focus in the input string.
+	(scanToken does the work; with --stats the time spent is added to 'lex'.)
 
 	Parameters: (All parameters are passed by-reference)
 	in str - The remaining code yet to be parsed. This function changes the original string object.
@@ -63,14 +317,32 @@ function err(string $errType, string $errMsg, string $str) : void
 	Boolean - Whether or not function succeeded in parsing next token.
 */
 function getNextTok(string &$str, ?string &$type, ?string &$value) : bool
+{
+	if (!Stats::$enabled)
+		return scanToken($str, $type, $value);
+
+	$start = microtime(true);
+	try {
+		$found = scanToken($str, $type, $value);
+	}
+	finally {
+		Stats::time('lex', $start);
+	}
+	if ($found)
+		Stats::count('tokens lexed');
+	return $found;
+}
+
+function scanToken(string &$str, ?string &$type, ?string &$value) : bool
 {
 	$str = ltrim($str);
+	$GLOBALS['tokenOffset'] = strlen($GLOBALS['source']) - strlen($str);
 	if (strlen($str) === 0) return false;
 
 	if (substr($str, 0, 2) === '//') {
 		if (($pos = strpos($str, "\n")) !== false) {
 			$str = substr($str, $pos + 1);
-			return getNextTok($str, $type, $value);
+			return scanToken($str, $type, $value);
 		}
 		else {
 			return false;
@@ -80,7 +352,7 @@ function getNextTok(string &$str, ?string &$type, ?string &$value) : bool
 	if (substr($str, 0, 3) === '/**') {
 		if (($pos = strpos($str, '*/')) !== false) {
 			$str = substr($str, $pos + 2);
-			return getNextTok($str, $type, $value);
+			return scanToken($str, $type, $value);
 		}
 		else {
 			return false;
@@ -88,6 +360,8 @@ function getNextTok(string &$str, ?string &$type, ?string &$value) : bool
 	}
 
 	foreach($GLOBALS['regExps'] as $key => $regex) {
+		if (Stats::$enabled)
+			Stats::count('regex calls');
 		if (preg_match($regex, $str, $match, PREG_OFFSET_CAPTURE) && $match[0][1] === 0) {
 			$type = $key;
 			$value = $match[0][0];
@@ -97,7 +371,7 @@ function getNextTok(string &$str, ?string &$type, ?string &$value) : bool
 	}
 
 	// If function has not returned by here, then input string was invalid.
-	err('Parse', 'Could not parse next token', $str);
+	err('Parse', "Unexpected character '" . $str[0] . "'");
 }
 
 /*
@@ -121,10 +395,11 @@ function lookAheadOne(string $str) : string
 function match(string &$str, $valids) : string
 {
 	if (!getNextTok($str, $type, $val))
-		err('Parse', 'Unexpected end of file reached', $str);
+		err('Parse', 'Unexpected end of file reached');
 	if (!in_array($val, $valids) && !in_array($type, $valids)){
-		err('Parse', 'Unexpected token type or value', $str);
+		err('Parse', "Unexpected '$val', expected " . implode(' or ', $valids));
 	}
+	$GLOBALS['matchOffset'] = $GLOBALS['tokenOffset'];
 
 	return $val;
 }
@@ -135,6 +410,8 @@ function match(string &$str, $valids) : string
 */
 function matchPeek(string $str, $valids) : bool
 {
+	if (Stats::$enabled)
+		Stats::count('matchPeek calls');
 	if (getNextTok($str, $type, $val)) {
 		if (in_array($val, $valids) || in_array($type, $valids)) {
 			return true;
@@ -168,60 +445,88 @@ function pop(string $kind, int $index) : string
 }
 
 /*
-	Returns the 'kind' of a symbol by first looking it up in the current
-	subroutine symbol table, and then if not there in the class symbol table.
+	Returns the record [kind, index, type] of a symbol (see SymbolTable). The
+	subroutine's symbol table is chained to the class symbol table, so this is a
+	single lookup that falls back to the class scope.
 */
-function kind(string $name, SymbolTable $subTable) : string
+function lookup(string $name, SymbolTable $subTable) : array
 {
-	if ($subTable->isDefined($name))
-		return $subTable->kindOf($name);
-	if ($GLOBALS['classSymbTable']->isDefined($name))
-		return $GLOBALS['classSymbTable']->kindOf($name);
+	if (Stats::$enabled)
+		Stats::count('symbol lookups');
+	$symbol = $subTable->lookup($name);
+	if ($symbol === null)
+		err('Compile', "Encountered undefined variable '$name'", $GLOBALS['matchOffset']);
 
-	err('Compile', 'Encountered undefined variable', $str);
+	return $symbol;
 }
 
-// Similar to kind but returns symbol index.
-function index(string $name, SymbolTable $subTable) : int
+// Prints VM code pushing the value of a variable.
+function pushVar(string $name, SymbolTable $subTable) : string
 {
-	if ($subTable->isDefined($name))
-		return $subTable->indexOf($name);
-	if ($GLOBALS['classSymbTable']->isDefined($name))
-		return $GLOBALS['classSymbTable']->indexOf($name);
-
-	err('Compile', 'Encountered undefined variable', $str);
+	$symbol = lookup($name, $subTable);
+	return push($symbol[SymbolTable::KIND], $symbol[SymbolTable::INDEX]);
 }
 
-// Similar to kind but returns symbol type.
-function type(string $name, SymbolTable $subTable) : string
+// Prints VM code popping into a variable.
+function popVar(string $name, SymbolTable $subTable) : string
 {
-	if ($subTable->isDefined($name))
-		return $subTable->typeOf($name);
-	if ($GLOBALS['classSymbTable']->isDefined($name))
-		return $GLOBALS['classSymbTable']->typeOf($name);
-
-	err('Compile', 'Encountered undefined variable', $str);
+	$symbol = lookup($name, $subTable);
+	return pop($symbol[SymbolTable::KIND], $symbol[SymbolTable::INDEX]);
 }
 
 // Globally defined
 $classSymbTable = null;
 $className = '';
+$classIndex = null;
+
+// Label counters of 'if' and 'while' statements. Reset for every class so that the
+// output of a class only depends on its own source (see the build cache).
+$ifCounter = 0;
+$whileCounter = 0;
+$condCounter = 0;
+
+// With --static-image: whether the statement being compiled is in the leading run of
+// constant stores of an init function, and what the run stored so far, as static
+// index => value and RAM address => value
+$hoisting = false;
+$staticImage = ['statics' => [], 'ram' => []];
+
+// With --pooled-alloc: the size of the class's objects if it has a constructor, or 0
+$poolSize = 0;
+// Whether the class being compiled has an object pool, see --pooled-alloc
+$pooled = false;
 
 // Starts the parsing and compiling of the input from the root variable 'class'
 function parseClass(string &$str) : string
 {
 	$GLOBALS['classSymbTable'] = new SymbolTable(); // Instantiating the class (global) symbol table
+	$GLOBALS['ifCounter'] = 0;
+	$GLOBALS['whileCounter'] = 0;
+	$GLOBALS['condCounter'] = 0;
+	$GLOBALS['staticImage'] = ['statics' => [], 'ram' => []];
+	$GLOBALS['poolSize'] = 0;
 	match($str, ['class']);
 	$GLOBALS['className'] = match($str, ['identifier']);
+	// known before any subroutine is compiled, as 'do Memory.deAlloc(this)' may come first
+	$GLOBALS['pooled'] = in_array('pooled-alloc', $GLOBALS['codegenFlags'])
+		&& $GLOBALS['classIndex']->hasConstructor($GLOBALS['className']);
 	match($str, ['{']);
 	while (matchPeek($str, ['static', 'field'])) {
-		parseClassVarDec($str);
+		try {
+			parseClassVarDec($str);
+		}
+		catch(SourceError $e) {
+			report($e);
+			recover($str);
+		}
 	}
 	$retString = '';
 	while (matchPeek($str, ['constructor', 'function', 'method'])) {
 		$retString .= parseSubroutineDec($str);
 	}
 	match($str, ['}']);
+	if ($GLOBALS['poolSize'] > 0)
+		$retString .= poolFunctions();
 
 	return $retString;
 }
@@ -246,7 +551,7 @@ function parseClassVarDec(string &$str) : void
 
 function parseSubroutineDec(string &$str) : string
 {
-	$subTable = new SymbolTable(); // Instantiating this subroutine's symbol table
+	$subTable = new SymbolTable($GLOBALS['classSymbTable']); // Instantiating this subroutine's symbol table, chained to the class's
 	$subType = match($str, ['constructor', 'function', 'method']);
 	if ($subType === 'method')
 		$subTable->define('this', $GLOBALS['className'], 'arg');
@@ -261,12 +566,23 @@ function parseSubroutineDec(string &$str) : string
 		$retBody .= push('arg', 0);
 		$retBody .= pop('pointer', 0);
 	}
+	else if ($subType === 'constructor' && in_array('pooled-alloc', $GLOBALS['codegenFlags'])) {
+		// the free list links objects through their first word, so they take at least one
+		$GLOBALS['poolSize'] = max(1, $GLOBALS['classSymbTable']->kindCount('field'));
+		$retBody .= 'call ' . $GLOBALS['className'] . ".\$alloc 0\n";
+		$retBody .= pop('pointer', 0);
+	}
 	else if ($subType === 'constructor') {
 		$retBody .= push('constant', $GLOBALS['classSymbTable']->kindCount('field'));
 		$retBody .= "call Memory.alloc 1\n";
 		$retBody .= pop('pointer', 0);
 	}
+	$GLOBALS['hoisting'] = in_array('static-image', $GLOBALS['codegenFlags'])
+		&& $subType === 'function' && $subName === 'init'
+		&& $GLOBALS['classIndex']->initRunsOnce($GLOBALS['className']);
 	$retBody .= parseSubroutineBody($str, $subTable);
+	$GLOBALS['hoisting'] = false;
+	$retBody = reuseThatPointer($retBody);
 
 	$retString = 'function ' . $GLOBALS['className'] . ".$subName "
 		. $subTable->kindCount('var') . "\n$retBody";
@@ -274,6 +590,53 @@ function parseSubroutineDec(string &$str) : string
 	return $retString;
 }
 
+/*
+	Returns the VM functions of the class's object pool (see --pooled-alloc), a free
+	list in a static variable, linked through the first word of the objects:
+
+		Class.$alloc()     takes the first object of the list, or allocates one
+		                   with Memory.alloc if the list is empty
+		Class.$free(obj)   puts obj at the front of the list
+
+	'$' is not allowed in Jack names, so they cannot clash with the class's own
+	subroutines.
+*/
+function poolFunctions() : string
+{
+	$table = $GLOBALS['classSymbTable'];
+	$table->define('$pool', 'int', 'static');
+	$pool = $table->lookup('$pool')[SymbolTable::INDEX];
+	$className = $GLOBALS['className'];
+
+	$retString = "function $className.\$alloc 0\n";
+	$retString .= push('static', $pool);
+	$retString .= push('constant', 0);
+	$retString .= "eq\n";
+	$retString .= "if-goto POOL_EMPTY\n";
+	$retString .= push('static', $pool);
+	$retString .= pop('pointer', 1);
+	$retString .= push('that', 0);
+	$retString .= pop('static', $pool);
+	$retString .= push('pointer', 1);
+	$retString .= "return\n";
+	$retString .= "label POOL_EMPTY\n";
+	$retString .= push('constant', $GLOBALS['poolSize']);
+	$retString .= "call Memory.alloc 1\n";
+	$retString .= "return\n";
+
+	$retString .= "function $className.\$free 0\n";
+	$retString .= push('arg', 0);
+	$retString .= pop('pointer', 1);
+	$retString .= push('static', $pool);
+	$retString .= pop('that', 0);
+	$retString .= push('arg', 0);
+	$retString .= pop('static', $pool);
+	$retString .= push('constant', 0);
+	$retString .= "return\n";
+
+	return $retString;
+}
+
 // Similar to parseClassVarDec in that it only adds to a symbol table.
 function parseParameterList(string &$str, SymbolTable $subTable) : void
 {
@@ -294,9 +657,17 @@ function parseSubroutineBody(string &$str, SymbolTable $subTable) : string
 {
 	match($str, ['{']);
 	while (matchPeek($str, ['var'])) {
-		parseVarDec($str, $subTable);
+		try {
+			parseVarDec($str, $subTable);
+		}
+		catch(SourceError $e) {
+			report($e);
+			recover($str);
+		}
 	}
 	$retString = parseStatements($str, $subTable);
+	if (Stats::$enabled) // here rather than in parseStatements, which also returns the nested bodies
+		Stats::count('bytes concatenated', strlen($retString));
 	match($str, ['}']);
 
 	return $retString;
@@ -320,22 +691,33 @@ function parseVarDec(string &$str, SymbolTable $subTable) : void
 function parseStatements(string &$str, SymbolTable $subTable) : string
 {
 	$retString = '';
+	$hoist = $GLOBALS['hoisting']; // only the body's own statements, not nested ones
 	while (matchPeek($str, ['let', 'if', 'while', 'do', 'return'])) {
-		if (matchPeek($str, ['let']))
-			$retString .= parseLetStatement($str, $subTable);
+		$length = strlen($retString);
+		$GLOBALS['hoisting'] = $hoist && matchPeek($str, ['let']);
+		try {
+			if (matchPeek($str, ['let']))
+				$retString .= parseLetStatement($str, $subTable);
 
-		else if (matchPeek($str, ['if']))
-			$retString .= parseIfStatement($str, $subTable);
+			else if (matchPeek($str, ['if']))
+				$retString .= parseIfStatement($str, $subTable);
 
-		else if (matchPeek($str, ['while']))
-			$retString .= parseWhileStatement($str, $subTable);
+			else if (matchPeek($str, ['while']))
+				$retString .= parseWhileStatement($str, $subTable);
 
-		else if (matchPeek($str, ['do']))
-			$retString .= parseDoStatement($str, $subTable);
+			else if (matchPeek($str, ['do']))
+				$retString .= parseDoStatement($str, $subTable);
 
-		else if (matchPeek($str, ['return']))
-			$retString .= parseReturnStatement($str, $subTable);
+			else if (matchPeek($str, ['return']))
+				$retString .= parseReturnStatement($str, $subTable);
+		}
+		catch(SourceError $e) {
+			report($e);
+			recover($str);
+		}
+		$hoist = $hoist && strlen($retString) === $length; // a compiled statement ends the run
 	}
+	$GLOBALS['hoisting'] = false;
 
 	return $retString;
 }
@@ -347,43 +729,203 @@ function parseLetStatement(string &$str, SymbolTable $subTable) : string
 
 	match($str, ['let']);
 	$destVar = match($str, ['identifier']);
+	lookup($destVar, $subTable); // reports an undefined variable at its name
 	if (matchPeek($str, ['['])) {
-		$retString .= push(kind($destVar, $subTable), index($destVar, $subTable));
 		match($str, ['[']);
-		$retString .= parseExpression($str, $subTable);
+		$index = parseExpression($str, $subTable);
 		match($str, [']']);
-		$retString .= "add\n";
 		$isArr = true;
 	}
 	match($str, ['=']);
-	$retString .= parseExpression($str, $subTable);
+	$value = parseExpression($str, $subTable);
 	match($str, [';']);
-	if ($isArr) {
-		$retString .= pop('temp', 0);
-		$retString .= pop('pointer', 1);
-		$retString .= push('temp', 0);
-		$retString .= pop('that', 0);
+	if ($GLOBALS['hoisting'] && hoistLet($destVar, $isArr ? $index : null, $value, $subTable))
+		return '';
+	if (!$isArr)
+		return $value . popVar($destVar, $subTable);
+
+	// THAT can be set before the value is computed unless the value itself is an array
+	// read. (Calls do not change THAT: it is restored when they return.)
+	if (strpos($value, "pop pointer 1\n") === false) {
+		$access = arrayAccess($destVar, $index, $subTable, true);
+		return $access[0] . $value . pop('that', $access[1]);
 	}
-	else
-		$retString .= pop(kind($destVar, $subTable), index($destVar, $subTable));
+	$retString .= pushVar($destVar, $subTable);
+	$retString .= $index;
+	$retString .= "add\n";
+	$retString .= $value;
+	$retString .= pop('temp', 0);
+	$retString .= pop('pointer', 1);
+	$retString .= push('temp', 0);
+	$retString .= pop('that', 0);
 
 	return $retString;
 }
 
-// IDEA: Maybe reset 'if' and 'while' counters for every class.
+/*
+	With --static-image, evaluates a 'let' of the leading run of an init function at
+	compile time if it stores a constant into a static variable, or into an element
+	of an array that a static of the run points to, at a constant index (e.g.
+	'let freeList[0] = 14335;' after 'let freeList = 2048;'). The store is added to
+	the class's static image instead of being compiled. Returns whether it was.
+
+	An array allocated at run time, e.g. with Array.new, has no address yet, so the
+	run ends at such a 'let'.
+*/
+function hoistLet(string $name, ?string $index, string $value, SymbolTable $subTable) : bool
+{
+	$symbol = lookup($name, $subTable);
+	if ($symbol[SymbolTable::KIND] !== 'static')
+		return false;
+	$static = $symbol[SymbolTable::INDEX];
+	$known = $GLOBALS['staticImage']['statics'];
+	$word = evaluateConstant($value, $known);
+	if ($word === null)
+		return false;
+	if ($index === null) {
+		$GLOBALS['staticImage']['statics'][$static] = $word;
+		return true;
+	}
+
+	$offset = evaluateConstant($index, $known);
+	if ($offset === null || !array_key_exists($static, $known))
+		return false;
+	$address = ($known[$static] + $offset) & 0xFFFF;
+	if ($address < HEAP_BASE || $address >= 16384) // only the heap: the rest is set up at startup
+		return false;
+	$GLOBALS['staticImage']['ram'][$address] = $word;
+	return true;
+}
+
+/*
+	Returns the value of an expression's VM code if it only combines constants and
+	the statics in $statics (index => value), or null. The arithmetic is the Hack
+	arithmetic on 16-bit words; comparisons test the sign of the difference, as the
+	VM translator does. Products and quotients are only evaluated when the program
+	does not have a Math class of its own, whose multiply and divide could differ
+	from the OS's.
+*/
+function evaluateConstant(string $vm, array $statics) : ?int
+{
+	$stack = [];
+	foreach (explode("\n", rtrim($vm, "\n")) as $command) {
+		$words = explode(' ', $command);
+		if ($words[0] === 'push' && count($words) === 3) {
+			if ($words[1] === 'constant')
+				$stack[] = (int)$words[2];
+			else if ($words[1] === 'static' && array_key_exists((int)$words[2], $statics))
+				$stack[] = $statics[(int)$words[2]];
+			else
+				return null;
+			continue;
+		}
+
+		if (count($stack) === 0)
+			return null;
+		$y = array_pop($stack);
+		if ($command === 'neg' || $command === 'not') {
+			$result = ($command === 'neg') ? -$y : ~$y;
+		}
+		else {
+			if (count($stack) === 0)
+				return null;
+			$x = array_pop($stack);
+			$difference = wordValue($x - $y);
+			switch ($command) {
+			case 'add': $result = $x + $y; break;
+			case 'sub': $result = $x - $y; break;
+			case 'and': $result = $x & $y; break;
+			case 'or': $result = $x | $y; break;
+			case 'lt': $result = ($difference < 0) ? -1 : 0; break;
+			case 'gt': $result = ($difference > 0) ? -1 : 0; break;
+			case 'eq': $result = ($difference === 0) ? -1 : 0; break;
+			case 'call Math.multiply 2':
+				if ($GLOBALS['classIndex']->hasClass('Math'))
+					return null;
+				$result = $x * $y;
+				break;
+			case 'call Math.divide 2':
+				if ($y === 0 || $GLOBALS['classIndex']->hasClass('Math'))
+					return null;
+				$result = (int)($x / $y);
+				break;
+			default:
+				return null;
+			}
+		}
+		$stack[] = wordValue($result);
+	}
+
+	return (count($stack) === 1) ? $stack[0] : null;
+}
+
+// A value as a signed 16-bit word.
+function wordValue(int $value) : int
+{
+	return (($value + 32768) & 0xFFFF) - 32768;
+}
+
+/*
+	Returns [code, offset]: VM code pointing THAT at an element of the array in
+	variable $name, given the code of the index expression, and the offset of the
+	element from THAT. A constant index becomes the offset; then THAT is the
+	array's base address, which reuseThatPointer() can reuse between accesses.
+	$baseFirst keeps the order in which 'let' evaluates the variable and the index.
+*/
+function arrayAccess(string $name, string $index, SymbolTable $subTable, bool $baseFirst = false) : array
+{
+	if (preg_match('/^push constant (\d+)\n$/', $index, $match)) {
+		return [pushVar($name, $subTable) . pop('pointer', 1), (int)$match[1]];
+	}
+
+	$address = $baseFirst ? pushVar($name, $subTable) . $index : $index . pushVar($name, $subTable);
+	return [$address . "add\n" . pop('pointer', 1), 0];
+}
+
+/*
+	Drops the 'push var; pop pointer 1' of an array access when THAT already holds
+	that variable's value: an earlier access set it, and since then control has not
+	joined from elsewhere (a label), the variable has not been assigned and THAT has
+	not been set to anything else. Only locals and arguments are tracked; fields and
+	statics may change in calls or through other arrays.
+*/
+function reuseThatPointer(string $vm) : string
+{
+	$lines = explode("\n", $vm);
+	$out = [];
+	$base = ''; // the variable THAT holds, e.g. 'local 2', or '' if unknown
+	for ($i = 0; $i < count($lines); $i++) {
+		$words = explode(' ', $lines[$i]);
+		if ($words[0] === 'push' && ($words[1] === 'local' || $words[1] === 'argument')
+			&& $i + 1 < count($lines) && $lines[$i + 1] === 'pop pointer 1') {
+			$var = $words[1] . ' ' . $words[2];
+			$i++;
+			if ($var === $base)
+				continue;
+			$out[] = "push $var";
+			$out[] = 'pop pointer 1';
+			$base = $var;
+			continue;
+		}
+
+		$out[] = $lines[$i];
+		if ($words[0] === 'label' || ($words[0] === 'pop'
+			&& ($words[1] . ' ' . $words[2] === $base || ($words[1] === 'pointer' && $words[2] === '1'))))
+			$base = '';
+	}
+
+	return implode("\n", $out);
+}
+
 function parseIfStatement(string &$str, SymbolTable $subTable) : string
 {
-	static $ifCounter = 0;
-	$currCounter = $ifCounter++;
+	$currCounter = $GLOBALS['ifCounter']++;
 
 	match($str, ['if']);
 	match($str, ['(']);
-	$retString = parseExpression($str, $subTable);
+	$retString = branchOn(parseExpressionParts($str, $subTable), false, "IF_FALSE$currCounter"); // jump over the 'then' part
 	match($str, [')']);
-	$retString .= "if-goto IF_TRUE$currCounter\n";
-	$retString .= "goto IF_FALSE$currCounter\n";
 	match($str, ['{']);
-	$retString .= "label IF_TRUE$currCounter\n";
 	$retString .= parseStatements($str, $subTable);
 	match($str, ['}']);
 	if (matchPeek($str, ['else'])) {
@@ -403,24 +945,103 @@ function parseIfStatement(string &$str, SymbolTable $subTable) : string
 
 function parseWhileStatement(string &$str, SymbolTable $subTable) : string
 {
-	static $whileCounter = 0;
-	$currCounter = $whileCounter++;
+	// The condition is tested at the bottom of the loop, so an iteration takes a single
+	// conditional jump back to the top. As before, the loop only goes on while the
+	// condition is true (-1), see affirm.
+	$currCounter = $GLOBALS['whileCounter']++;
 	match($str, ['while']);
-	$retString = "label WHILE_EXP$currCounter\n";
 	match($str, ['(']);
-	$retString .= parseExpression($str, $subTable);
+	$condition = parseExpressionParts($str, $subTable);
 	match($str, [')']);
-	$retString .= "not\n";
 	match($str, ['{']);
-	$retString .= "if-goto WHILE_END$currCounter\n";
+	$retString = "goto WHILE_EXP$currCounter\n";
+	$retString .= "label WHILE_BODY$currCounter\n";
 	$retString .= parseStatements($str, $subTable);
 	match($str, ['}']);
-	$retString .= "goto WHILE_EXP$currCounter\n";
-	$retString .= "label WHILE_END$currCounter\n";
+	$retString .= "label WHILE_EXP$currCounter\n";
+	$retString .= branchOn($condition, true, "WHILE_BODY$currCounter");
 
 	return $retString;
 }
 
+/*
+	Returns VM code that is true exactly when the condition is false (zero). A
+	comparison is -1 or 0, so 'not' negates it; any other value is compared with
+	zero. The VM translator turns both forms followed by 'if-goto' into a single
+	conditional jump.
+*/
+function negate(string $condition) : string
+{
+	$last = substr($condition, -4);
+	if ($last === "\neq\n" || $last === "\nlt\n" || $last === "\ngt\n")
+		return $condition . "not\n";
+	return $condition . "push constant 0\neq\n";
+}
+
+/*
+	Returns VM code that is non-zero exactly when the condition is true (-1), the
+	test a while loop has always made ('not' of anything else is non-zero). A
+	comparison is already -1 or 0; other values are tested with 'not' and compared
+	with zero, which the VM translator also turns into a single conditional jump.
+*/
+function affirm(string $condition) : string
+{
+	$last = substr($condition, -4);
+	if ($last === "\neq\n" || $last === "\nlt\n" || $last === "\ngt\n")
+		return $condition;
+	return $condition . "not\npush constant 0\neq\n";
+}
+
+/*
+	Returns VM code that evaluates a condition (see parseExpressionParts) and jumps
+	to $label when it is $when: false is zero, and true is -1 (see affirm). A
+	condition that only joins comparisons with '&' and '|', and makes no calls, is
+	compiled to a chain of jumps that stops at the first comparison that decides
+	it, e.g. for (x < 10) & (y > 0) and $when = false:
+
+		push x, push 10, lt, not, if-goto label
+		push y, push 0, gt, not, if-goto label
+
+	The VM translator compiles each comparison and its jump to a single conditional
+	jump. Other conditions are evaluated in full and tested once.
+*/
+function branchOn(array $parts, bool $when, string $label) : string
+{
+	list($terms, $ops) = $parts;
+	$chain = count($ops) > 0;
+	foreach ($ops as $op)
+		$chain = $chain && ($op === '&' || $op === '|');
+	foreach ($terms as $term) {
+		$last = substr($term, -4);
+		$chain = $chain && ($last === "\neq\n" || $last === "\nlt\n" || $last === "\ngt\n")
+			&& strpos($term, 'call ') === false;
+	}
+	if (!$chain) {
+		$condition = joinExpression($terms, $ops);
+		return ($when ? affirm($condition) : negate($condition)) . "if-goto $label\n";
+	}
+
+	return branchChain($terms, $ops, count($terms), $when, $label);
+}
+
+// The jumps of branchOn for the condition made of the first $n terms
+function branchChain(array $terms, array $ops, int $n, bool $when, string $label) : string
+{
+	if ($n === 1)
+		return ($when ? affirm($terms[0]) : negate($terms[0])) . "if-goto $label\n";
+
+	// A & B is false if A is false, A | B is true if A is true. Otherwise B decides.
+	$decidedByLeft = ($ops[$n - 2] === '&') !== $when;
+	if ($decidedByLeft)
+		return branchChain($terms, $ops, $n - 1, $when, $label)
+			. branchOn([[$terms[$n - 1]], []], $when, $label);
+
+	$skip = 'COND_SKIP' . $GLOBALS['condCounter']++;
+	return branchChain($terms, $ops, $n - 1, !$when, $skip)
+		. branchOn([[$terms[$n - 1]], []], $when, $label)
+		. "label $skip\n";
+}
+
 function parseDoStatement(string &$str, SymbolTable $subTable) : string
 {
 	match($str, ['do']);
@@ -448,10 +1069,32 @@ function parseReturnStatement(string &$str, SymbolTable $subTable) : string
 
 function parseExpression(string &$str, SymbolTable $subTable) : string
 {
-	$retString = parseTerm($str, $subTable);
+	list($terms, $ops) = parseExpressionParts($str, $subTable);
+	return joinExpression($terms, $ops);
+}
+
+/*
+	Parses an expression into the VM code of its terms and its operators, in
+	order: [[term code, ...], [op, ...]]. Jack has no operator precedence, so the
+	expression is ((term0 op0 term1) op1 term2) ...
+*/
+function parseExpressionParts(string &$str, SymbolTable $subTable) : array
+{
+	$terms = [parseTerm($str, $subTable)];
+	$ops = [];
 	while (matchPeek($str, ['+', '-', '*', '/', '&', '|', '<', '>','='])) {
-		$op = match($str, ['+', '-', '*', '/', '&', '|', '<', '>', '=']);
-		$retString .= parseTerm($str, $subTable);
+		$ops[] = match($str, ['+', '-', '*', '/', '&', '|', '<', '>', '=']);
+		$terms[] = parseTerm($str, $subTable);
+	}
+
+	return [$terms, $ops];
+}
+
+function joinExpression(array $terms, array $ops) : string
+{
+	$retString = $terms[0];
+	foreach ($ops as $k => $op) {
+		$retString .= $terms[$k + 1];
 		switch($op) {
 		case '+':
 			$retString .= "add\n";
@@ -522,17 +1165,16 @@ function parseTerm(string &$str, SymbolTable $subTable) : string
 		}
 		else {
 			$name = match($str, ['identifier']);
+			lookup($name, $subTable); // reports an undefined variable at its name
 			if (matchPeek($str, ['['])) {
 				match($str, ['[']);
-				$retString = parseExpression($str, $subTable);
+				$access = arrayAccess($name, parseExpression($str, $subTable), $subTable);
 				match($str, [']']);
-				$retString .= push(kind($name, $subTable), index($name, $subTable));
-				$retString .= "add\n";
-				$retString .= pop('pointer', 1);
-				$retString .= push('that', 0);
+				$retString = $access[0];
+				$retString .= push('that', $access[1]);
 			}
 			else {
-				$retString = push(kind($name, $subTable), index($name, $subTable));
+				$retString = pushVar($name, $subTable);
 			}
 		}
 	}
@@ -549,7 +1191,8 @@ function parseTerm(string &$str, SymbolTable $subTable) : string
 		else if ($unaryOp === '~')
 			$retString .= "not\n";
 	}
-	// else { possibly need Exception thrown here }
+	else
+		err('Parse', 'Expected a term');
 
 	return $retString;
 }
@@ -558,33 +1201,75 @@ function parseSubroutineCall(string &$str, SymbolTable $subTable) : string
 {
 	$retString = '';
 	$numArgs = 0;
+	$hasReceiver = false;
 
 	$className = match($str, ['identifier']);
+	$callOffset = $GLOBALS['matchOffset'];
 	if (matchPeek($str, ['.'])) {
 		match($str, ['.']);
 		$subName = match($str, ['identifier']);
+
+		$symbol = $subTable->lookup($className);
+		if ($symbol !== null) { // 'var.sub()' - a method call on the object in var
+			$retString .= push($symbol[SymbolTable::KIND], $symbol[SymbolTable::INDEX]);
+			$className = $symbol[SymbolTable::TYPE];
+			$numArgs++;
+			$hasReceiver = true;
+		}
 	}
 	else {
 		$subName = $className;
 		$className = $GLOBALS['className'];
-		$retString .= push('pointer', 0);
-		$numArgs++;
-	}
-
-	if ($subTable->isDefined($className) || $GLOBALS['classSymbTable']->isDefined($className)) {
-		$retString .= push(kind($className, $subTable), index($className, $subTable));
-		$className = type($className, $subTable);
-		$numArgs++;
+		// 'sub()' is a method call on this object, unless the class index says that sub is a function
+		$decl = $GLOBALS['classIndex']->lookup($className, $subName);
+		if ($decl === null || $decl[ClassIndex::KIND] === 'method') {
+			$retString .= push('pointer', 0);
+			$numArgs++;
+			$hasReceiver = true;
+		}
 	}
 
 	match($str, ['(']);
-	$retString .= parseExpressionList($str, $subTable, $numArgs);
+	$args = parseExpressionList($str, $subTable, $numArgs);
+	$retString .= $args;
 	match($str, [')']);
-	$retString .= "call $className.$subName $numArgs\n";
+	checkCall($className, $subName, $numArgs, $hasReceiver, $callOffset);
+	// with --pooled-alloc, Memory.deAlloc(this) puts the object back into the class's pool
+	if ($GLOBALS['pooled'] && "$className.$subName" === 'Memory.deAlloc' && $args === push('pointer', 0))
+		$retString .= 'call ' . $GLOBALS['className'] . ".\$free 1\n";
+	else
+		$retString .= "call $className.$subName $numArgs\n";
 
 	return $retString;
 }
 
+/*
+	Checks a call against the class index: the subroutine must exist, methods
+	must be called on an object and functions and constructors without one, and
+	the number of arguments must match. Calls to classes outside the program
+	(e.g. the OS) are not checked. Errors are reported at $offset, the start of the call.
+*/
+function checkCall(string $className, string $subName, int $numArgs, bool $hasReceiver, int $offset) : void
+{
+	if (!$GLOBALS['classIndex']->hasClass($className))
+		return;
+
+	$decl = $GLOBALS['classIndex']->lookup($className, $subName);
+	if ($decl === null)
+		err('Compile', "Call to undefined subroutine $className.$subName", $offset);
+
+	$isMethod = $decl[ClassIndex::KIND] === 'method';
+	if ($isMethod && !$hasReceiver)
+		err('Compile', "Method $className.$subName called without an object", $offset);
+	if (!$isMethod && $hasReceiver)
+		err('Compile', "The " . $decl[ClassIndex::KIND] . " $className.$subName called on an object", $offset);
+
+	$expected = $decl[ClassIndex::NUM_PARAMS] + ($isMethod ? 1 : 0);
+	if ($numArgs !== $expected)
+		err('Compile', "$className.$subName expects " . $decl[ClassIndex::NUM_PARAMS] . ' argument(s), got '
+			. ($numArgs - ($isMethod ? 1 : 0)), $offset);
+}
+
 function parseExpressionList(string &$str, SymbolTable $subTable, int &$numArgs) : string
 {
 	$retString = '';
@@ -0,0 +1,92 @@
+<?hh //strict
+
+/*
+	Opt-in counters and phase timers for the course tools (--stats=FILE in
+	Compiler.hh, Parser.hh and Assembler.hh).
+
+	Counters and times are kept for the file being worked on (see startFile) and
+	for the whole run. While disabled, the only cost at a call site is the test
+	of Stats::$enabled, which the hot paths do before calling in:
+
+		if (Stats::$enabled)
+			Stats::count('regex calls');
+
+	The summary is JSON:
+
+		{"files": {"Main.jack": {"counters": {...}, "seconds": {...}}, ...},
+		 "total": {"counters": {...}, "seconds": {...}}}
+
+	Work done before the first file, or for the program as a whole, is only in
+	the total.
+*/
+class Stats {
+	public static bool $enabled = false;
+
+	private static string $file = '';
+	private static array<string, array> $files = [];
+	private static array $total = ['counters' => [], 'seconds' => []];
+
+	// Charges the counters and times that follow to $file.
+	public static function startFile(string $file) : void
+	{
+		self::$file = $file;
+		if (!isset(self::$files[$file]))
+			self::$files[$file] = ['counters' => [], 'seconds' => []];
+	}
+
+	// Forgets everything counted so far, e.g. before another build of a --watch run.
+	public static function reset() : void
+	{
+		self::$file = '';
+		self::$files = [];
+		self::$total = ['counters' => [], 'seconds' => []];
+	}
+
+	// Stops charging a file; what follows only goes into the total.
+	public static function endFile() : void
+	{
+		self::$file = '';
+	}
+
+	public static function count(string $counter, int $amount = 1) : void
+	{
+		self::add('counters', $counter, $amount);
+	}
+
+	/*
+		Adds the time since $start (a microtime(true) value) to a phase, e.g.
+
+			$start = microtime(true);
+			...
+			Stats::time('write', $start);
+	*/
+	public static function time(string $phase, float $start) : void
+	{
+		self::add('seconds', $phase, microtime(true) - $start);
+	}
+
+	public static function summary() : array
+	{
+		return ['files' => self::$files, 'total' => self::$total];
+	}
+
+	// Writes the summary to $fileName, or prints it if $fileName is empty.
+	public static function write(string $fileName) : void
+	{
+		$json = json_encode(self::summary(), JSON_PRETTY_PRINT) . "\n";
+		if ($fileName === '')
+			echo $json;
+		else
+			file_put_contents($fileName, $json);
+	}
+
+	private static function add(string $kind, string $name, num $amount) : void
+	{
+		$total = self::$total[$kind];
+		self::$total[$kind][$name] = (isset($total[$name]) ? $total[$name] : 0) + $amount;
+		if (self::$file === '')
+			return;
+		$own = self::$files[self::$file][$kind];
+		self::$files[self::$file][$kind][$name] = (isset($own[$name]) ? $own[$name] : 0) + $amount;
+	}
+}
@@ -1,22 +1,29 @@
 <?hh //strict
 
+/*
+	A symbol table for one scope. Every entry is a packed record [kind, index, type]
+	stored under its name. A subroutine's table is chained to its class's table, so
+	a single lookup() resolves a name in the innermost scope that defines it.
+*/
 class SymbolTable {
+	const int KIND = 0;
+	const int INDEX = 1;
+	const int TYPE = 2;
+
+	private ?SymbolTable $parent;
 	private array<string, int> $indices;
-	private array<string, array<string, mixed>> $table;
+	private array<string, array> $table;
 
-	public function __construct()
+	public function __construct(?SymbolTable $parent = null)
 	{
+		$this->parent = $parent;
 		$this->indices = ['static' => 0, 'field' => 0, 'arg' => 0, 'var' => 0];
 		$this->table = [];
 	}
 
 	public function define(string $name, string $type, string $kind) : void
 	{
-		$this->table[$name] = [
-			'type' => $type,
-			'kind' => $kind,
-			'index' => $this->indices[$kind]
-		];
+		$this->table[$name] = [$kind, $this->indices[$kind], $type];
 		$this->indices[$kind]++;
 	}
 
@@ -25,23 +32,38 @@ class SymbolTable {
 		return $this->indices[$kind];
 	}
 
+	/*
+		Returns the record [kind, index, type] of a name, searching this table and
+		then the tables it is chained to, or null if no scope defines the name.
+	*/
+	public function lookup(string $name) : ?array
+	{
+		$scope = $this;
+		while ($scope !== null) {
+			if (isset($scope->table[$name]))
+				return $scope->table[$name];
+			$scope = $scope->parent;
+		}
+		return null;
+	}
+
 	public function kindOf(string $name) : string
 	{
-		return (string)$this->table[$name]['kind'];
+		return (string)$this->lookup($name)[self::KIND];
 	}
 
 	public function typeOf(string $name) : string
 	{
-		return (string)$this->table[$name]['type'];
+		return (string)$this->lookup($name)[self::TYPE];
 	}
 
 	public function indexOf(string $name) : int
 	{
-		return (int)$this->table[$name]['index'];
+		return (int)$this->lookup($name)[self::INDEX];
 	}
 
 	public function isDefined(string $name) : bool
 	{
-		return array_key_exists($name, $this->table);
+		return $this->lookup($name) !== null;
 	}
 }
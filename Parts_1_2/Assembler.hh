@@ -2,63 +2,555 @@
 
 // Compiles VM to Hack
 
+include('Linker.hh');
+include('CallGraph.hh');
+include('Inliner.hh');
+include('Optimizer.hh');
+include(__DIR__.'/../Part_5/Stats.hh');
+include(__DIR__.'/../Part_5/Common.hh');
+
+/*
+ * Command line:  Assembler.hh [sourceDir [destFile]] [--no-cache] [--cache-dir=DIR] [--remove-dead-code]
+ *                              [--plain-frames] [--inline-limit=N] [--static-frames] [--stats[=FILE]]
+ *                              [--watch[=MS]] [--stream] [--bootstrap=jump|call|none] [--stack-base=N]
+ *                              [--ram-image=FILE] [--optimize]
+ *
+ * Each .vm file is translated into its own relocatable fragment of Hack code whose
+ * generated labels are namespaced by the file name (see Linker.hh). Fragments are
+ * kept in an on-disk cache keyed by a hash of the VM source, the translator version
+ * and the flags, so unchanged files are not retranslated. The fragments are then
+ * linked into a single program; linking fails if a called function is not defined.
+ * With --remove-dead-code, functions that cannot be reached from Sys.init are left out.
+ *
+ * With --inline-limit=N, calls to small non-recursive functions of up to N VM commands are
+ * replaced by the functions' bodies before translating (see Inliner.hh). It is off by default.
+ * With --optimize, the functions are then lifted into expression trees over basic blocks,
+ * rewritten by copy propagation, dead store elimination and common subexpression
+ * elimination, and lowered back to VM commands (see Optimizer.hh).
+ * Then the call graph of the whole program is analysed (see CallGraph.hh).
+ * Calls to functions that can never change THIS or THAT get a smaller frame that does
+ * not save them, unless --plain-frames is given. With --static-frames, the locals of
+ * non-recursive functions, and the arguments they use more than once, are kept in fixed
+ * RAM slots in the static area (see allocateFrameSlots) instead of the Stack.
+ *
+ * With --stats=FILE the run is instrumented (see Part_5/Stats.hh) and a JSON summary is
+ * written to FILE, or printed with --stats. Per .vm file it counts the VM commands, regex
+ * calls, fused command sequences and bytes of Hack code concatenated, and times 'translate'; the
+ * total also times 'read', 'inline', 'optimize', 'analyse', 'link' and 'write'.
+ *
+ * With --watch[=MS] the translator keeps running and polls the source directory every MS
+ * milliseconds (default 500), e.g. next to Part_5/Compiler.hh --watch. When a .vm file
+ * or a static image changes, only the files whose code can differ are translated again; the fragments are
+ * kept in memory between builds, and the .asm file is rewritten only when it changes.
+ *
+ * With --stream the files are translated a line at a time and the Hack code is written
+ * through a buffer of STREAM_BUFFER_SIZE bytes, so the data the translator keeps does not
+ * grow with the size of the input (see streamDirectory). This is meant for huge generated VM files; the
+ * whole-program passes, the cache and the link checks are skipped.
+ *
+ * The program starts with the startup code chosen by --bootstrap (see bootstrapCode),
+ * with the Stack at --stack-base (default 256). --ram-image=FILE stores precomputed
+ * words (see readRamImage) before anything runs, e.g. tables that the program would
+ * otherwise build in Sys.init. The static images the compiler writes with
+ * --static-image (see readStaticImage) are stored the same way.
+ */
 function main() {
   echo "This script takes VM source and outputs the compiled Hack assembly.\n";
-  $srcDir = readline('Enter the source directory:  ');
+  $cmdLine = parseCommandLine();
+  $args = $cmdLine['args'];
+  $options = $cmdLine['options'];
+  # the source directory and destination may also be given on the command line (used by the benchmarks)
+  $srcDir = (count($args) > 0)? $args[0] : readline('Enter the source directory:  ');
   $srcDir = getcwd().'/'.trim($srcDir); # getcwd == 'get current working directory'
 
-  $dstFileName = readline('Enter destination filename:  ');
+  $dstFileName = (count($args) > 1)? $args[1] : readline('Enter destination filename:  ');
   $dstFileName = getcwd().'/'.trim($dstFileName);
   if (pathinfo($dstFileName, PATHINFO_EXTENSION) !== 'asm') # make sure destination has extension 'asm'
     $dstFileName .= '.asm';
 
-  $paths = scandir($srcDir);
-  array_splice($paths, 0, 2); # the first two elements in the array are: '.', '..' - these are unneeded
+  $cacheDir = array_key_exists('no-cache', $options)? '' :
+    (array_key_exists('cache-dir', $options)? $options['cache-dir'] : "$srcDir/.buildcache");
+  Stats::$enabled = array_key_exists('stats', $options);
+  if (array_key_exists('plain-frames', $options))
+    $GLOBALS['CodegenFlags'][] = 'plain-frames';
+  if (array_key_exists('static-frames', $options))
+    $GLOBALS['CodegenFlags'][] = 'static-frames';
+  try {
+    if (array_key_exists('bootstrap', $options)) {
+      if (!in_array($options['bootstrap'], ['jump', 'call', 'none']))
+        throw new Exception("Bootstrap Error: unknown bootstrap '".$options['bootstrap']."'");
+      $GLOBALS['Bootstrap'] = $options['bootstrap'];
+    }
+    if (array_key_exists('stack-base', $options))
+      $GLOBALS['StackBase'] = max(0, min(32767 - 5, intval($options['stack-base'])));
+    if (array_key_exists('ram-image', $options))
+      $GLOBALS['RamImage'] = readRamImage($options['ram-image']);
+  } catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+    return;
+  }
+
+  if (array_key_exists('stream', $options)) {
+    streamDirectory($srcDir, $dstFileName);
+    return;
+  }
+  if (!array_key_exists('watch', $options)) {
+    translateDirectory($srcDir, $dstFileName, $cacheDir, $options);
+    return;
+  }
+
+  $interval = ($options['watch'] !== '')? max(50, intval($options['watch'])) : 500;
+  echo "Watching $srcDir for changes, press Ctrl-C to stop.\n";
+  $signature = '';
+  while (true) {
+    $current = directorySignature($srcDir, 'vm').directorySignature($srcDir, 'json'); # with the static images
+    if ($current !== $signature) {
+      $signature = $current;
+      translateDirectory($srcDir, $dstFileName, $cacheDir, $options);
+      echo "\nWaiting for changes...\n";
+    }
+    usleep($interval * 1000);
+  }
+}
 
-  $dstFile = fopen("$dstFileName", 'w'); # creating dest file
+# File name => [cache key, fragment] of the files translated by this process (see --watch)
+$WarmFragments = [];
 
-  # bootstrap code
-  $bootstrap = "@261\n";
-  $bootstrap .= "D=A\n";
-  $bootstrap .= "@SP\n";
-  $bootstrap .= "M=D\n";
-  $bootstrap .= "@Sys.init\n";
-  $bootstrap .= "0;JMP\n";
-  fwrite($dstFile, $bootstrap);
+# The program last written by this process
+$WrittenProgram = '';
 
+# The startup code (see bootstrapCode), where the Stack starts, and the RAM image stored before the program runs
+$Bootstrap = 'jump';
+$StackBase = 256;
+$RamImage = [];
+
+# The words of the static images the compiler wrote next to the VM files (see readStaticImage)
+$StaticImages = [];
+
+/*
+ * Translates the .vm files of $srcDir and links them into $dstFileName. Fragments this
+ * process already translated with the same cache key are reused without a message, so
+ * in --watch mode a build only retranslates the files whose code can differ; the
+ * whole-program passes, which are cheap next to translating, are run again every time.
+ */
+function translateDirectory(string $srcDir, string $dstFileName, string $cacheDir, array $options): void {
+  Stats::reset(); # every --watch build gets a summary of its own
+  $start = microtime(true);
+  $paths = scandir($srcDir);
+  array_splice($paths, 0, 2); # the first two elements in the array are: '.', '..' - these are unneeded
+
+  $sources = [];
+  $GLOBALS['StaticImages'] = [];
   foreach ($paths as $key) {
     if (pathinfo($key, PATHINFO_EXTENSION) !== 'vm') # checks if the file has extension other than 'vm'. If so, skip over
       continue;
+    # The file name will be used to name static variables and generated labels
+    $sources[strtok($key, '.')] = file_get_contents("$srcDir/$key");
+    try {
+      $GLOBALS['StaticImages'] += readStaticImage($srcDir, strtok($key, '.'));
+    } catch (Exception $e) {
+      echo $e->getMessage(), "\n";
+      return;
+    }
+  }
+  if (Stats::$enabled)
+    Stats::time('read', $start);
+
+  # whole-program optimization and analysis. The cache keys below use the optimized sources.
+  $start = microtime(true);
+  $inlineLimit = array_key_exists('inline-limit', $options)? intval($options['inline-limit']) : DEFAULT_INLINE_LIMIT;
+  if ($inlineLimit > 0)
+    $sources = vmProgramSources(inlineSmallFunctions(parseVmProgram($sources), $inlineLimit));
+  if (Stats::$enabled)
+    Stats::time('inline', $start);
+  if (array_key_exists('optimize', $options)) {
+    $start = microtime(true);
+    $sources = vmProgramSources(optimizeProgram(parseVmProgram($sources)));
+    if (Stats::$enabled)
+      Stats::time('optimize', $start);
+  }
+  $start = microtime(true);
+  $graph = buildCallGraph($sources);
+  if (!array_key_exists('plain-frames', $options))
+    $GLOBALS['PointerPreserving'] = pointerPreservingFunctions($graph);
+  if (array_key_exists('static-frames', $options)) {
+    # the static variables, including the ones only an image stores, come first
+    $statics = countStatics($sources, array_keys($GLOBALS['RamImage'] + $GLOBALS['StaticImages']));
+    $GLOBALS['FrameSlots'] = allocateFrameSlots($graph, STATIC_AREA_SIZE - $statics, STATIC_AREA_BASE + $statics);
+  }
+  if (Stats::$enabled)
+    Stats::time('analyse', $start);
+
+  $fragments = [];
+  foreach ($sources as $fileName => $source) {
+    $GLOBALS['FileName'] = $fileName;
+    if (Stats::$enabled)
+      Stats::startFile($fileName.'.vm');
+
+    $fileSlots = [];
+    foreach ($GLOBALS['FrameSlots'] as $name => $slots) {
+      if ($graph[$name]['file'] === $fileName)
+        $fileSlots[$name] = $slots;
+    }
+    $cacheKey = sha1(TRANSLATOR_VERSION."\0".implode(' ', $GLOBALS['CodegenFlags'])."\0".$fileName."\0"
+      .factsKey($graph, $GLOBALS['PointerPreserving'], $fileName)."\0".json_encode($fileSlots)."\0".$source);
+    $warm = array_key_exists($fileName, $GLOBALS['WarmFragments'])? $GLOBALS['WarmFragments'][$fileName] : null;
+    if ($warm !== null && $warm[0] === $cacheKey) {
+      $fragments[] = $warm[1];
+      continue;
+    }
+    $cached = cacheLoad($cacheDir, $cacheKey, 'frag');
+    if ($cached !== null) {
+      echo "\nUsing cached ".$fileName.".vm...\n";
+      $fragment = json_decode($cached, true);
+      if (Stats::$enabled)
+        Stats::count('cache hits');
+    } else {
+      echo "\nWorking on ".$fileName.".vm...\n";
+      $start = microtime(true);
+      $fragment = translateFile($source);
+      if (Stats::$enabled)
+        Stats::time('translate', $start);
+      cacheStore($cacheDir, $cacheKey, 'frag', json_encode($fragment));
+    }
+    $GLOBALS['WarmFragments'][$fileName] = [$cacheKey, $fragment];
+    $fragments[] = $fragment;
+  }
 
-    # The global variable 'FileName' will be used to name static variables
-    $GLOBALS['FileName'] = strtok($key, '.');
+  if (Stats::$enabled)
+    Stats::endFile();
+
+  $start = microtime(true);
+  try {
+    $program = linkProgram($fragments, array_key_exists('remove-dead-code', $options));
+  } catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+    return;
+  }
+  if (Stats::$enabled)
+    Stats::time('link', $start);
+
+  $bootstrap = bootstrapCode();
+  $start = microtime(true);
+  if ($bootstrap.$program !== $GLOBALS['WrittenProgram'] || !file_exists($dstFileName)) {
+    file_put_contents($dstFileName, $bootstrap.$program); # the whole program is written at once
+    $GLOBALS['WrittenProgram'] = $bootstrap.$program;
+  }
+  if (Stats::$enabled) {
+    Stats::time('write', $start);
+    Stats::write($options['stats']);
+  }
+}
+
+/*
+ * Returns the startup code that runs before the program (see --bootstrap):
+ *
+ *   jump  sets up the state a call of the entry function would leave - ARG at the Stack
+ *         base, SP and LCL 5 words above it - and jumps to it
+ *   call  sets SP, LCL and ARG to the Stack base and THIS and THAT to 0, and calls the
+ *         entry function with 'call Sys.init 0'
+ *   none  no startup code, for test programs that set up the RAM themselves
+ *
+ * The words of the RAM image and the static images, if any, are stored first, with
+ * every bootstrap.
+ */
+function bootstrapCode(): string {
+  $retString = ramImageCode($GLOBALS['RamImage'] + $GLOBALS['StaticImages']);
+  if ($GLOBALS['Bootstrap'] === 'none')
+    return $retString;
+
+  $base = $GLOBALS['StackBase'];
+  $entry = $GLOBALS['EntryFunction'];
+  if ($GLOBALS['Bootstrap'] === 'jump') {
+    $retString .= "@$base\n";
+    $retString .= "D=A\n";
+    $retString .= "@ARG\n";
+    $retString .= "M=D\n";
+    $retString .= "@5\n";
+    $retString .= "D=D+A\n"; # the size of a frame saving THIS and THAT
+    $retString .= "@SP\n";
+    $retString .= "M=D\n";
+    $retString .= "@LCL\n";
+    $retString .= "M=D\n";
+    $retString .= "@$entry\n";
+    $retString .= "0;JMP\n";
+
+    return $retString;
+  }
+
+  $retString .= "@$base\n";
+  $retString .= "D=A\n";
+  foreach (['SP', 'LCL', 'ARG'] as $pointer)
+    $retString .= "@$pointer\nM=D\n";
+  $retString .= "@THIS\nM=0\n";
+  $retString .= "@THAT\nM=0\n";
+  # the return address label is namespaced like a file's, by a name no VM file can have
+  list($fileName, $labelCounter) = [$GLOBALS['FileName'], $GLOBALS['LabelCounter']];
+  $GLOBALS['FileName'] = '$bootstrap';
+  $GLOBALS['LabelCounter'] = 0;
+  $retString .= call($entry, '0');
+  list($GLOBALS['FileName'], $GLOBALS['LabelCounter']) = [$fileName, $labelCounter];
+
+  return $retString;
+}
+
+/*
+ * Returns code storing the words of a RAM image (address or symbol => value, see
+ * --ram-image). 0, 1 and -1 are stored directly; other values go through D, which is
+ * only reloaded when the value changes.
+ */
+function ramImageCode(array $image): string {
+  $retString = '';
+  $inD = null;
+  foreach ($image as $address => $value) {
+    if ($value >= -1 && $value <= 1) {
+      $retString .= "@$address\n";
+      $retString .= "M=$value\n";
+      continue;
+    }
+    if ($value !== $inD) {
+      $retString .= constantToD($value);
+      $inD = $value;
+    }
+    $retString .= "@$address\n";
+    $retString .= "M=D\n";
+  }
+
+  return $retString;
+}
+
+/*
+ * Reads the static image that Part_5/Compiler.hh --static-image wrote next to a VM file,
+ * $srcDir/$fileName.image.json, if there is one: {"statics": {index: value, ...},
+ * "ram": {address: value, ...}}. Returns its words as a RAM image (see readRamImage),
+ * with the statics named like the file's static variables.
+ */
+function readStaticImage(string $srcDir, string $fileName): array {
+  $path = "$srcDir/$fileName.image.json";
+  if (!file_exists($path))
+    return [];
+  $image = json_decode(file_get_contents($path), true);
+  if (!is_array($image) || !is_array($image['statics']) || !is_array($image['ram'])) {
+    echo "Ignoring $path: not a static image\n";
+    return [];
+  }
+
+  $words = [];
+  foreach ($image['statics'] as $index => $value)
+    $words["$fileName.$index"] = intval($value);
+  foreach ($image['ram'] as $address => $value) {
+    checkImageAddress(intval($address), $path);
+    $words[intval($address)] = intval($value);
+  }
+
+  return $words;
+}
+
+/*
+ * Throws an Exception if the startup code or the Stack overwrite the word at $address
+ * (the registers R0-R15, and the Stack from --stack-base up to the heap), so a RAM
+ * image must not store it.
+ */
+function checkImageAddress(int $address, string $fileName): void {
+  $base = $GLOBALS['StackBase'];
+  $stackEnd = ($base < HEAP_BASE)? HEAP_BASE : 16384;
+  if ($address < 16 || ($address >= $base && $address < $stackEnd))
+    throw new Exception("Bootstrap Error: address $address in $fileName is overwritten at startup (a register or the Stack)");
+}
+
+/*
+ * Loads a 16-bit value (-32768..32767) into D. Only values from 0 to 32767 can be
+ * loaded with an A-instruction, so negative values are built from their negation.
+ */
+function constantToD(int $value): string {
+  if ($value >= -1 && $value <= 1)
+    return "D=$value\n";
+  if ($value >= 0)
+    return "@$value\nD=A\n";
+  if ($value === -32768)
+    return "@32767\nD=!A\n"; # !32767 = -32768
+  return "@".(-$value)."\nD=-A\n";
+}
+
+/*
+ * Reads a RAM image file: a JSON object mapping addresses, or symbols of the program
+ * such as 'Main.0' (a static variable), to the values to store there. Values are
+ * taken as 16-bit words, so 65535 and -1 are the same. Throws an Exception if the file
+ * is not a valid image, or stores a word the startup code overwrites (see
+ * checkImageAddress).
+ */
+function readRamImage(string $fileName): array {
+  $image = @json_decode((string)@file_get_contents($fileName), true);
+  if (!is_array($image))
+    throw new Exception("Bootstrap Error: $fileName is not a JSON object of address => value");
+
+  $words = [];
+  foreach ($image as $address => $value) {
+    $address = strval($address);
+    if (!preg_match('/^(?:\d+|[A-Za-z_.$:][\w.$:]*)$/', $address) || (ctype_digit($address) && intval($address) > 32767))
+      throw new Exception("Bootstrap Error: '$address' in $fileName is not an address or a symbol");
+    if (ctype_digit($address))
+      checkImageAddress(intval($address), $fileName);
+    if (!is_int($value) || $value < -32768 || $value > 65535)
+      throw new Exception("Bootstrap Error: the value of '$address' in $fileName is not a 16-bit word");
+    $words[$address] = (($value + 32768) & 0xFFFF) - 32768; # as a signed word
+  }
+
+  return $words;
+}
+
+# Bytes of Hack code collected before each write in --stream mode
+const STREAM_BUFFER_SIZE = 65536;
 
-    echo "\nWorking on ".$key."...\n";
+/*
+ * Translates the .vm files of $srcDir into $dstFileName in a single pass that keeps at
+ * most a few VM commands and STREAM_BUFFER_SIZE bytes of Hack code in memory: each file
+ * is read with fgets(), through a window of the next commands that fusedCommands() looks
+ * at, and the code is written out whenever the buffer fills up. This bounds what is live
+ * on the PHP heap by the window and the buffer; every line still allocates short-lived
+ * strings and arrays, and the process's resident size is up to the runtime (see
+ * --stream-check in Benchmarks/Benchmark.hh).
+ *
+ * Nothing about the whole program is known in advance, so there is no inlining, no
+ * smaller frames or frame slots, no dead code removal and no check of the function
+ * names. The generated labels are namespaced by file name (see Linker.hh), so the
+ * files' code can still be written one after the other.
+ */
+function streamDirectory(string $srcDir, string $dstFileName): void {
+  $out = fopen($dstFileName, 'wb');
+  if ($out === false) {
+    echo "Could not open $dstFileName\n";
+    return;
+  }
+  $GLOBALS['StaticImages'] = [];
+  try {
+    foreach (scandir($srcDir) as $key) {
+      if (pathinfo($key, PATHINFO_EXTENSION) === 'vm')
+        $GLOBALS['StaticImages'] += readStaticImage($srcDir, strtok($key, '.'));
+    }
+  } catch (Exception $e) {
+    echo $e->getMessage(), "\n";
+    fclose($out);
+    return;
+  }
+  $buffer = bootstrapCode();
 
-    $srcFile = fopen("$srcDir/$key", 'r');
+  foreach (scandir($srcDir) as $key) {
+    if (pathinfo($key, PATHINFO_EXTENSION) !== 'vm')
+      continue;
+    echo "\nStreaming ".$key."...\n";
+    $GLOBALS['FileName'] = strtok($key, '.');
+    $GLOBALS['LabelCounter'] = 0;
+    $GLOBALS['CurrentFunction'] = '';
+    $in = fopen("$srcDir/$key", 'rb');
+    $window = [];
+    while (true) {
+      while (count($window) < 4 && ($line = fgets($in)) !== false) {
+        $line = trim($line);
+        if ($line !== '' && $line[0] !== '/') # skip empty lines and comments
+          $window[] = $line;
+      }
+      if (count($window) === 0)
+        break;
 
-    while (!feof($srcFile)) {
-      $line = trim(fgets($srcFile));
-      if (substr($line, 0, 2) === '//' || feof($srcFile)) { # if the line is a comment, skip it
-        continue;
+      $fused = fusedCommands($window, 0);
+      if ($fused !== null) {
+        $buffer .= $fused['code'];
+        $window = array_slice($window, $fused['length']);
       } else {
-        fwrite($dstFile, compile($line)); # write the compiled line to the dest file
+        $buffer .= compile(explode(' ', array_shift($window), 5));
+      }
+      if (strlen($buffer) >= STREAM_BUFFER_SIZE) {
+        fwrite($out, $buffer);
+        $buffer = '';
       }
     }
-    fclose($srcFile);
+    fclose($in);
   }
-  fclose($dstFile);
+
+  fwrite($out, $buffer);
+  fclose($out);
 }
 
+# Bump this whenever the generated code changes, so that stale cache entries are not reused
+const TRANSLATOR_VERSION = '2016.11';
+
+# Options that change the generated code. They are part of every cache key.
+$CodegenFlags = [];
+
 $FileName = '';
 
+# Functions whose calls do not save and restore THIS and THAT (see pointerPreservingFunctions)
+$PointerPreserving = [];
+
+# RAM 16-255 holds the static variables, and the frame slots after them
+const STATIC_AREA_BASE = 16;
+const STATIC_AREA_SIZE = 240;
+
+# Function name => its frame slots (see allocateFrameSlots), for --static-frames
+$FrameSlots = [];
+
+# Functions with up to this many locals zero them with straight-line code, others with a loop
+const UNROLLED_LOCALS_LIMIT = 6;
+
+# Counter used to make the labels generated for comparisons and calls unique within a file
+$LabelCounter = 0;
+
 /*
- * This function takes a line of VM code, processes it, and outputs its equivalent Hack code.
+ * Translates the source of one VM file into a relocatable fragment (see Linker.hh): its
+ * Hack code split by function, together with the functions each one calls. The fragment
+ * only depends on the file's contents and name: its generated labels are prefixed with
+ * the file name and numbered from zero.
  */
-function compile(string $line): string {
-  $command = explode(' ', $line, 5); # convert line into an array of literals
-  switch (trim($command[0])) {
-    # the 'trim' solves compatibility issues for files written in Windows
+function translateFile(string $source): array {
+  $GLOBALS['LabelCounter'] = 0;
+  $GLOBALS['CurrentFunction'] = '';
+  $fragment = ['file' => $GLOBALS['FileName'], 'header' => '', 'functions' => []];
+  $current = -1; # index of the function being translated
+
+  # A single pass over the source finds every command, trimmed. Empty lines and comment
+  # lines are skipped by the pattern, and '\r' of files written in Windows is dropped.
+  preg_match_all('/^[ \t]*([^\s\/][^\r\n]*?)[ \t\r]*$/m', $source, $matches);
+  $lines = $matches[1];
+  if (Stats::$enabled) {
+    Stats::count('regex calls');
+    Stats::count('vm commands', count($lines));
+  }
+  for ($i = 0; $i < count($lines); $i++) {
+    $command = explode(' ', $lines[$i], 5); # convert line into an array of literals
+    if ($command[0] === 'function') {
+      $fragment['functions'][] = ['name' => $command[1], 'calls' => [], 'code' => ''];
+      $current = count($fragment['functions']) - 1;
+    }
+
+    $fused = fusedCommands($lines, $i);
+    if ($fused !== null) {
+      $code = $fused['code'];
+      $i += $fused['length'] - 1;
+      if (Stats::$enabled)
+        Stats::count('fused commands');
+    } else {
+      $code = compile($command);
+    }
+    if (Stats::$enabled)
+      Stats::count('bytes concatenated', strlen($code));
+    if ($current < 0) {
+      $fragment['header'] .= $code;
+    } else {
+      $fragment['functions'][$current]['code'] .= $code; # append the compiled line to its function
+      if ($command[0] === 'call')
+        $fragment['functions'][$current]['calls'][$command[1]] = true;
+    }
+  }
+
+  return $fragment;
+}
+
+/*
+ * This function takes a line of VM code, split into its words, and outputs its equivalent Hack code.
+ */
+function compile(array $command): string {
+  switch ($command[0]) {
 
     # Arithmetic operators
     case 'add':
@@ -122,6 +614,9 @@ function compile(string $line): string {
     case 'return':
       $retString = returnCmd();
       break;
+    case 'drop': # only emitted by the optimizer (see Optimizer.hh)
+      $retString = "@SP\nM=M-1\n";
+      break;
 
     default:
       return '';
@@ -130,23 +625,61 @@ function compile(string $line): string {
   return $retString;
 }
 
+/*
+ * Segment access. Each 'push' or 'pop' is compiled by the cheapest of a few emitters,
+ * chosen by segment and offset (instruction counts, the 4 of pushRegD / 4 of popToReg
+ * included):
+ *
+ *   segment                      push              pop
+ *   static, temp, pointer        6                 6        the address is known, '@addr'
+ *   local/argument/this/that     7, 8, 9 (0-2)     7, 8, 9  walk from the base pointer
+ *                                9 (other)         9        '@offset D=A', and no R13
+ *
+ * compared with 10 for every push and 12 for every pop before.
+ */
+
+# Segments addressed through a base pointer, and segments at fixed RAM addresses
+const POINTER_SEGMENTS = ['local' => 'LCL', 'argument' => 'ARG', 'this' => 'THIS', 'that' => 'THAT'];
+const FIXED_SEGMENTS = ['pointer' => 3, 'temp' => 5];
+
+# Offsets of up to this size are reached by incrementing A rather than adding D
+const SMALL_OFFSET_LIMIT = 2;
+
+/*
+ * Outputs Hack assembly which points A at basePointer[offset]. Small offsets (negative
+ * ones too) leave D untouched.
+ */
+function addressOf(string $basePointer, int $offset): string {
+  $retString = "@$basePointer\n";
+  $steps = abs($offset);
+  if ($steps > SMALL_OFFSET_LIMIT) {
+    $retString = "@$steps\n";
+    $retString .= "D=A\n";
+    $retString .= "@$basePointer\n";
+    $retString .= ($offset < 0)? "A=M-D\n" : "A=M+D\n";
+    return $retString;
+  }
+
+  $sign = ($offset < 0)? '-' : '+';
+  if ($steps === 0)
+    return $retString."A=M\n";
+  $retString .= "A=M{$sign}1\n";
+  for ($i = 1; $i < $steps; $i++)
+    $retString .= "A=A{$sign}1\n";
+
+  return $retString;
+}
+
 /*
 * Outputs Hack assembly which calculates a basePointer[offset] and stores the
-* result in register D.
+* result in register D. For a segment at a fixed address, $basePointer is that
+* address and the word is read directly.
 */
 function getRAM(string $basePointer, string $offset, bool $isStaticSeg): string {
-  $neg = false;
-  if ($offset[0] === '-') {
-    $offset = substr($offset, 1);
-    $neg = true;
-  }
-  $retString = "@$offset\n"; # load $offset into A
-  $retString .= "D=A\n";
-  $retString .= "@$basePointer\n"; # load the base pointer into A
-  $retString .= ($isStaticSeg)? "A=A+D\n" : (($neg)? "A=M-D\n" : "A=M+D\n");
-  $retString .= "D=M\n"; # load value of basePointer[offset] into D
+  if ($isStaticSeg)
+    return "@".strval(intval($basePointer) + intval($offset))."\nD=M\n";
 
-  return $retString;
+  return addressOf($basePointer, intval($offset))."D=M\n"; # load value of basePointer[offset] into D
 }
 
 /*
@@ -156,33 +689,22 @@ function push(string $segment, string $offset): string {
   if ($segment === 'constant') { # 'constant' is a special case
     return pushConstant($offset);
   }
+  $slot = frameSlot($segment, $offset);
+  if ($slot !== '') {
+    $retString = "@$slot\n";
+    $retString .= "D=M\n";
+    return $retString.pushRegD();
+  }
 
-  switch ($segment) {
-    case 'argument':
-      $retString = getRAM('ARG', $offset, false);
-      break;
-    case 'local':
-      $retString = getRAM('LCL', $offset, false);
-      break;
-    case 'static':
-      $retString = "@".$GLOBALS['FileName'].".$offset\n";
-      $retString .= "D=M\n";
-      break;
-    case 'this':
-      $retString = getRAM('THIS', $offset, false);
-      break;
-    case 'that':
-      $retString = getRAM('THAT', $offset, false);
-      break;
-    case 'pointer':
-      $retString = getRAM('3', $offset, true);
-      break;
-    case 'temp':
-      $retString = getRAM('5', $offset, true);
-      break;
-
-    default:
-      return '';
+  if ($segment === 'static') {
+    $retString = "@".$GLOBALS['FileName'].".$offset\n";
+    $retString .= "D=M\n";
+  } else if (array_key_exists($segment, FIXED_SEGMENTS)) {
+    $retString = getRAM(strval(FIXED_SEGMENTS[$segment]), $offset, true);
+  } else if (array_key_exists($segment, POINTER_SEGMENTS)) {
+    $retString = getRAM(POINTER_SEGMENTS[$segment], $offset, false);
+  } else {
+    return '';
   }
 
   $retString .= pushRegD(); # push value in D (segment[offset]) onto the Stack
@@ -191,10 +713,13 @@ function push(string $segment, string $offset): string {
 }
 
 /*
- * Pushes a constant value onto the Stack.
+ * Pushes a constant value, or the address of a label (e.g. a return address), onto the Stack.
  * Warning! Changes the value of register D!
  */
 function pushConstant(string $constVal): string {
+  if (ctype_digit($constVal))
+    return pushValue(intval($constVal));
+
   $retString = "@$constVal\n"; # A = $constVal
   $retString .= "D=A\n"; # D = $constVal
   $retString .= pushRegD(); # pushes register D onto the Stack
@@ -202,16 +727,30 @@ function pushConstant(string $constVal): string {
   return $retString;
 }
 
+/*
+ * Pushes a 16-bit value onto the Stack. 0, 1 and -1 are stored without going through D.
+ */
+function pushValue(int $value): string {
+  if ($value < -1 || $value > 1)
+    return constantToD($value).pushRegD();
+
+  $retString = "@SP\n";
+  $retString .= "AM=M+1\n"; # increment SP by 1
+  $retString .= "A=A-1\n";
+  $retString .= "M=$value\n";
+
+  return $retString;
+}
+
 /*
  * Pushes value of register D onto the Stack.
  * WARNING! Function changes the value of register A!
  */
 function pushRegD(): string {
   $retString = "@SP\n";
-  $retString .= "A=M\n"; # A = address of top of Stack
-  $retString .= "M=D\n"; # top of Stack = D ($constVal)
-  $retString .= "@SP\n";
-  $retString .= "M=M+1\n"; # increment SP by 1
+  $retString .= "AM=M+1\n"; # increment SP by 1
+  $retString .= "A=A-1\n"; # A = address of the new top of Stack
+  $retString .= "M=D\n"; # top of Stack = D
 
   return $retString;
 }
@@ -232,56 +771,64 @@ function pushBasePointer(string $base): string {
  * Pops the top of the Stack into segment[offset].
  */
 function pop(string $segment, string $offset): string {
-  # $loadBasePointer will be the segment base pointer
-  # $loadAddress will be the method we use to calculate segment[offset]
-  switch ($segment) {
-    case 'argument':
-      $loadBasePointer = "ARG";
-      $loadAddress = "D=M+D";
-      break;
-    case 'local':
-      $loadBasePointer = "LCL";
-      $loadAddress = "D=M+D";
-      break;
-    case 'static':
-      $retString = popToReg('D');
-      $retString.="@".$GLOBALS['FileName'].".$offset\n";
-      $retString.="M=D\n";
-      return $retString;
-    case 'this':
-      $loadBasePointer = "THIS";
-      $loadAddress = "D=M+D";
-      break;
-    case 'that':
-      $loadBasePointer = "THAT";
-      $loadAddress = "D=M+D";
-      break;
-    case 'pointer':
-      $loadBasePointer = "3";
-      $loadAddress = "D=A+D";
-      break;
-    case 'temp':
-      $loadBasePointer = "5";
-      $loadAddress = "D=A+D";
-      break;
-    default:
-      return '';
+  $slot = frameSlot($segment, $offset);
+  if ($slot !== '') {
+    $retString = popToReg('D');
+    $retString .= "@$slot\n";
+    $retString .= "M=D\n";
+    return $retString;
+  }
+
+  if ($segment === 'static' || array_key_exists($segment, FIXED_SEGMENTS)) {
+    $address = ($segment === 'static')? $GLOBALS['FileName'].".$offset" :
+      strval(FIXED_SEGMENTS[$segment] + intval($offset));
+    $retString = popToReg('D');
+    $retString .= "@$address\n";
+    $retString .= "M=D\n";
+    return $retString;
   }
+  if (!array_key_exists($segment, POINTER_SEGMENTS))
+    return '';
 
+  $basePointer = POINTER_SEGMENTS[$segment];
+  if (abs(intval($offset)) <= SMALL_OFFSET_LIMIT) {
+    $retString = popToReg('D');
+    $retString .= addressOf($basePointer, intval($offset)); # keeps D
+    $retString .= "M=D\n";
+    return $retString;
+  }
+
+  # D = address, then swap the value in through D + value without a temporary register
   $retString = "@$offset\n";
   $retString .= "D=A\n";
-  $retString .= "@$loadBasePointer\n";
-  $retString .= "$loadAddress\n";
-  $retString .= "@R13\n";
-  $retString .= "M=D\n";
-  $retString .= popToReg('D');
-  $retString .= "@R13\n";
-  $retString .= "A=M\n";
-  $retString .= "M=D\n";
+  $retString .= "@$basePointer\n";
+  $retString .= "D=M+D\n";
+  $retString .= "@SP\n";
+  $retString .= "AM=M-1\n";
+  $retString .= "D=D+M\n"; # D = address + value
+  $retString .= "A=D-M\n"; # A = address
+  $retString .= "M=D-A\n"; # RAM[address] = value
 
   return $retString;
 }
 
+/*
+ * Returns the RAM address of the slot holding segment[offset] of the current function,
+ * or '' if it lives on the Stack. Slots have fixed addresses after the static variables,
+ * so they do not depend on the order the Hack assembler allocates variables in.
+ */
+function frameSlot(string $segment, string $offset): string {
+  $func = $GLOBALS['CurrentFunction'];
+  if (!array_key_exists($func, $GLOBALS['FrameSlots']))
+    return '';
+  $slots = $GLOBALS['FrameSlots'][$func];
+  $kind = ($segment === 'local')? 'locals' : (($segment === 'argument')? 'args' : '');
+  if ($kind === '' || !array_key_exists(intval($offset), $slots[$kind]))
+    return '';
+
+  return strval($slots[$kind][intval($offset)]);
+}
+
 /*
  * Pops the top of the Stack into the given register.
  * WARNING! Function changes the value of register A!
@@ -334,21 +881,20 @@ function binary(string $op): string {
  * Generic comparison operator. Parameter 'op' can have the values: 'EQ', 'GT', or 'LT'
  */
 function comparison(string $op): string {
-  static $counter = 0;
+  $prefix = $GLOBALS['FileName'].':'; # generated labels are file-local
+  $counter = $GLOBALS['LabelCounter']++;
   $retString = popToReg('D');
   $retString .= popToReg('A');
   $retString .= "D=A-D\n";
-  $retString .= "@$op$counter\n";
+  $retString .= "@$prefix$op$counter\n";
   $retString .= "D;J$op\n";
-  $retString .= "@NOT_$op$counter\n";
+  $retString .= "@{$prefix}NOT_$op$counter\n";
   $retString .= "D=0;JMP\n";
-  $retString .= "($op$counter)\n";
+  $retString .= "($prefix$op$counter)\n";
   $retString .= "D=-1\n";
-  $retString .= "(NOT_$op$counter)\n";
+  $retString .= "({$prefix}NOT_$op$counter)\n";
   $retString .= pushRegD();
 
-  $counter++;
-
   return $retString;
 }
 
@@ -383,19 +929,136 @@ function ifgoto(string $label): string {
   return $retString;
 }
 
+/*
+ * Compiles a short sequence of VM commands starting at $lines[$i] that has better code
+ * together than command by command: a condition and its 'if-goto' (see fusedBranch), or
+ * a constant and what is done with it (see fusedConstant). Returns ['code' => Hack code,
+ * 'length' => number of VM commands used], or null to compile $lines[$i] on its own.
+ */
+function fusedCommands(array $lines, int $i): ?array {
+  $fused = fusedBranch($lines, $i);
+  return ($fused !== null)? $fused : fusedConstant($lines, $i);
+}
+
+# Jumps of the comparisons when fused with an 'if-goto': [condition true, condition false]
+const BRANCH_JUMPS = ['eq' => ['JEQ', 'JNE'], 'gt' => ['JGT', 'JLE'], 'lt' => ['JLT', 'JGE']];
+
+/*
+* Recognizes a condition directly followed by the 'if-goto' that tests it, starting
+* at $lines[$i], and compiles the pair to a single conditional jump so that no -1/0
+* is pushed:
+*
+*   eq|gt|lt, if-goto L           jump on the sign of x - y
+*   eq|gt|lt, not, if-goto L      the same with the opposite jump
+*   push constant 0, eq, if-goto L    jump if the top of the Stack is zero
+*   not, if-goto L                jump if the top of the Stack is not -1
+*   not, push constant 0, eq, if-goto L
+*                                 jump if the top of the Stack is -1
+*
+* Returns ['code' => Hack code, 'length' => number of VM commands used], or null.
+*/
+function fusedBranch(array $lines, int $i): ?array {
+  $next = array_slice($lines, $i, 4);
+  $targetAt = function(int $k) use ($next): string { # the label of an 'if-goto' at $next[$k], or ''
+    if ($k >= count($next) || substr($next[$k], 0, 8) !== 'if-goto ')
+      return '';
+    return '@'.$GLOBALS['CurrentFunction'].'$'.explode(' ', $next[$k])[1]."\n";
+  };
+
+  if (array_key_exists($next[0], BRANCH_JUMPS)) {
+    $jumps = BRANCH_JUMPS[$next[0]];
+    $length = ($targetAt(1) !== '')? 2 : ((count($next) >= 3 && $next[1] === 'not' && $targetAt(2) !== '')? 3 : 0);
+    if ($length === 0)
+      return null;
+    $retString = "@SP\n";
+    $retString .= "AM=M-1\n";
+    $retString .= "D=M\n"; # D = y
+    $retString .= "A=A-1\n";
+    $retString .= "D=M-D\n"; # D = x - y
+    $retString .= "@SP\n";
+    $retString .= "M=M-1\n";
+    $retString .= $targetAt($length - 1);
+    $retString .= "D;".$jumps[$length - 2]."\n";
+    return ['code' => $retString, 'length' => $length];
+  }
+  if ($next[0] === 'push constant 0' && count($next) >= 3 && $next[1] === 'eq' && $targetAt(2) !== '')
+    return ['code' => popToReg('D').$targetAt(2)."D;JEQ\n", 'length' => 3];
+  if ($next[0] === 'not' && $targetAt(1) !== '')
+    return ['code' => popToReg('D').$targetAt(1)."D+1;JNE\n", 'length' => 2];
+  if ($next[0] === 'not' && count($next) === 4 && $next[1] === 'push constant 0' && $next[2] === 'eq'
+      && $targetAt(3) !== '')
+    return ['code' => popToReg('D').$targetAt(3)."D+1;JEQ\n", 'length' => 4];
+
+  return null;
+}
+
+# Operators that can be applied to the top of the Stack in place, with a constant operand in D
+const CONSTANT_OPERATIONS = ['add' => 'D+M', 'sub' => 'M-D', 'and' => 'D&M', 'or' => 'D|M'];
+
+/*
+ * Recognizes a negative constant, 'push constant N, neg', and a constant used by the
+ * next command, 'push constant N [neg], add|sub|and|or'. The constant is loaded into D
+ * directly (or not at all, see constantOperation), instead of being pushed and popped.
+ *
+ * Returns ['code' => Hack code, 'length' => number of VM commands used], or null.
+ */
+function fusedConstant(array $lines, int $i): ?array {
+  if (!preg_match('/^push constant (\d+)$/', $lines[$i], $match))
+    return null;
+  $value = intval($match[1]);
+  $length = 1;
+  $next = ($i + 1 < count($lines))? $lines[$i + 1] : '';
+  if ($next === 'neg') {
+    $value = -$value;
+    $length = 2;
+    $next = ($i + 2 < count($lines))? $lines[$i + 2] : '';
+  }
+
+  if (array_key_exists($next, CONSTANT_OPERATIONS))
+    return ['code' => constantOperation($next, $value), 'length' => $length + 1];
+  if ($length === 2)
+    return ['code' => pushValue($value), 'length' => 2];
+
+  return null;
+}
+
+/*
+ * Applies 'add', 'sub', 'and' or 'or' with a constant right operand to the top of the
+ * Stack. Operands that leave the top unchanged need no code, and 0, 1 and -1 need not
+ * be loaded into D.
+ */
+function constantOperation(string $op, int $value): string {
+  if ($value === 0 && $op !== 'and' || $value === -1 && $op === 'and')
+    return ''; # x + 0, x - 0, x | 0 and x & -1 are x
+
+  $retString = "@SP\n";
+  $retString .= "A=M-1\n"; # A = address of the top of the Stack
+  if (($value === 1 || $value === -1) && ($op === 'add' || $op === 'sub'))
+    return $retString."M=M".((($op === 'add') === ($value === 1))? '+' : '-')."1\n";
+  if ($value === 0 || $value === -1) # x & 0, x | -1
+    return $retString."M=$value\n";
+
+  return constantToD($value).$retString."M=".CONSTANT_OPERATIONS[$op]."\n";
+}
+
 /*
 * Compiles the VM 'call' command to Hack. This means that it is partially
 * responsible for setting up the new Stack Frame on the
-* Global Stack.
+* Global Stack. If the called function can never change THIS and THAT, the
+* frame only holds the return address, LCL and ARG.
 */
 function call(string $func, string $numArgs): string {
-  static $counter = 0;
-  $retString = pushConstant("RETURN$counter");
+  $prefix = $GLOBALS['FileName'].':'; # generated labels are file-local
+  $counter = $GLOBALS['LabelCounter']++;
+  $savePointers = !array_key_exists($func, $GLOBALS['PointerPreserving']);
+  $retString = pushConstant("{$prefix}RETURN$counter");
   $retString .= pushBasePointer('LCL');
   $retString .= pushBasePointer('ARG');
-  $retString .= pushBasePointer('THIS');
-  $retString .= pushBasePointer('THAT');
-  $retString .= "@".strval(intval($numArgs) + 5)."\n";
+  if ($savePointers) {
+    $retString .= pushBasePointer('THIS');
+    $retString .= pushBasePointer('THAT');
+  }
+  $retString .= "@".strval(intval($numArgs) + ($savePointers? 5 : 3))."\n";
   $retString .= "D=A\n";
   $retString .= "@SP\n";
   $retString .= "D=M-D\n";
@@ -406,22 +1069,61 @@ function call(string $func, string $numArgs): string {
   $retString .= "@LCL\n";
   $retString .= "M=D\n";
   $retString .= gotoCmd($func, true);
-  $retString .= "(RETURN$counter)\n";
-
-  $counter++;
+  $retString .= "({$prefix}RETURN$counter)\n";
 
   return $retString;
 }
 
 /*
-* Compiles the VM 'function' command to Hack.
+* Compiles the VM 'function' command to Hack. The locals are zeroed with
+* straight-line code when there are only a few of them, and with a loop otherwise.
+* A function with frame slots zeroes its local slots and copies its arguments into
+* their slots instead.
 */
 function functionCmd(string $funcName, string $numLocals): string {
   $GLOBALS['CurrentFunction'] = $funcName;
   $retString = "($funcName)\n";
   $len = intval($numLocals);
-  for ($i = 0; $i < $len; $i++)
-    $retString .= pushConstant('0');
+  if (array_key_exists($funcName, $GLOBALS['FrameSlots'])) {
+    $slots = $GLOBALS['FrameSlots'][$funcName];
+    foreach ($slots['locals'] as $slot) {
+      $retString .= "@$slot\n";
+      $retString .= "M=0\n";
+    }
+    foreach ($slots['args'] as $index => $slot) {
+      $retString .= getRAM('ARG', strval($index), false);
+      $retString .= "@$slot\n";
+      $retString .= "M=D\n";
+    }
+    return $retString;
+  }
+  if ($len === 0)
+    return $retString;
+
+  if ($len <= UNROLLED_LOCALS_LIMIT) {
+    $retString .= "@SP\n";
+    $retString .= "A=M\n";
+    $retString .= "M=0\n"; # local 0
+    for ($i = 1; $i < $len; $i++) {
+      $retString .= "A=A+1\n";
+      $retString .= "M=0\n"; # local i
+    }
+    $retString .= "D=A+1\n";
+    $retString .= "@SP\n";
+    $retString .= "M=D\n"; # SP = LCL + $len
+  } else {
+    # '$' cannot appear in VM labels, so this cannot clash with the function's own labels
+    $retString .= "@$len\n";
+    $retString .= "D=A\n";
+    $retString .= "($funcName\$\$ZERO_LOCALS)\n";
+    $retString .= "@SP\n";
+    $retString .= "AM=M+1\n";
+    $retString .= "A=A-1\n";
+    $retString .= "M=0\n";
+    $retString .= "D=D-1\n";
+    $retString .= "@$funcName\$\$ZERO_LOCALS\n";
+    $retString .= "D;JGT\n";
+  }
 
   return $retString;
 }
@@ -429,23 +1131,36 @@ function functionCmd(string $funcName, string $numLocals): string {
 /*
 * Compiles the VM 'return' command to Hack. This means that it is responsible for
 * returning the Stack Frame to its previous state (for the calling function).
+* The saved pointers are restored by walking LCL down the frame.
 */
 function returnCmd(): string {
-  $retString = getRAM('LCL', '-5', false); # puts local[-5] into D
+  $pointers = array_key_exists($GLOBALS['CurrentFunction'], $GLOBALS['PointerPreserving'])?
+    ['ARG'] : ['THAT', 'THIS', 'ARG']; # the saved pointers, top of the frame first (LCL is restored last)
+
+  $retString = getRAM('LCL', strval(-(count($pointers) + 2)), false); # puts the return address into D
   $retString .= "@R14\n"; # R14 will be our temporary 'Ret' variable
   $retString .= "M=D\n"; # Ret = D
-  $retString .= pop('argument', '0'); # repositioning function's return value for the caller
+  $retString .= popToReg('D'); # repositioning function's return value for the caller
+  $retString .= "@ARG\n";
+  $retString .= "A=M\n";
+  $retString .= "M=D\n";
   $retString .= "@ARG\n";
   $retString .= "D=M+1\n";
   $retString .= "@SP\n";
   $retString .= "M=D\n"; # finished repositioning the SP for the calling function
 
-  $pointers = ['THAT', 'THIS', 'ARG', 'LCL'];
-  for ($i = 0; $i < 4; $i++) { # setting dynamic pointers to their previous values
-    $retString .= getRAM('LCL', strval(-($i+1)), false);
-    $retString .= "@".$pointers[$i]."\n";
+  foreach ($pointers as $pointer) { # setting dynamic pointers to their previous values
+    $retString .= "@LCL\n";
+    $retString .= "AM=M-1\n";
+    $retString .= "D=M\n";
+    $retString .= "@$pointer\n";
     $retString .= "M=D\n";
   }
+  $retString .= "@LCL\n";
+  $retString .= "A=M-1\n";
+  $retString .= "D=M\n";
+  $retString .= "@LCL\n";
+  $retString .= "M=D\n";
 
   $retString .= "@R14\n"; # jumping to address stored in 'Ret' (the return address)
   $retString .= "A=M\n";
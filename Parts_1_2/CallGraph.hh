@@ -0,0 +1,238 @@
+<?hh
+
+// Whole-program facts about the functions of a VM program
+
+/*
+ * Builds the call graph of the program from the sources of all of its VM files
+ * ($sources is file name => VM source). For each function it records:
+ *
+ *   [
+ *     'file' => the file that defines it,
+ *     'locals' => its number of locals,
+ *     'calls' => ['Other.func' => number of arguments, ...],
+ *     'writesPointers' => whether it pops into the 'pointer' segment (changes THIS or THAT),
+ *     'argUses' => [argument index => number of pushes and pops of it, ...]
+ *   ]
+ */
+function buildCallGraph(array $sources): array {
+  $graph = [];
+  foreach ($sources as $file => $source) {
+    $current = '';
+    foreach (explode("\n", $source) as $line) {
+      $command = explode(' ', trim($line));
+      switch ($command[0]) {
+        case 'function':
+          $current = $command[1];
+          $graph[$current] = ['file' => $file, 'locals' => intval($command[2]), 'calls' => [],
+            'writesPointers' => false, 'argUses' => []];
+          break;
+        case 'call':
+          if ($current !== '')
+            $graph[$current]['calls'][$command[1]] = intval($command[2]);
+          break;
+        case 'push':
+        case 'pop':
+          if ($current === '')
+            break;
+          if ($command[0] === 'pop' && $command[1] === 'pointer')
+            $graph[$current]['writesPointers'] = true;
+          if ($command[1] === 'argument') {
+            $index = intval($command[2]);
+            $uses = $graph[$current]['argUses'];
+            $graph[$current]['argUses'][$index] = (array_key_exists($index, $uses)? $uses[$index] : 0) + 1;
+          }
+          break;
+      }
+    }
+  }
+
+  return $graph;
+}
+
+/*
+ * Returns the set (name => true) of functions that can never change THIS or THAT:
+ * neither they nor anything they call, directly or indirectly, pops into the
+ * 'pointer' segment. Calls to functions outside the program are assumed to
+ * change them. A caller does not need to save THIS and THAT around a call to
+ * one of these functions.
+ */
+function pointerPreservingFunctions(array $graph): array {
+  $preserving = [];
+  foreach ($graph as $name => $function) {
+    if (!$function['writesPointers'])
+      $preserving[$name] = true;
+  }
+
+  # remove functions that call a function outside the set until nothing changes
+  do {
+    $changed = false;
+    foreach ($preserving as $name => $_) {
+      foreach ($graph[$name]['calls'] as $callee => $_) {
+        if (!array_key_exists($callee, $preserving)) {
+          unset($preserving[$name]);
+          $changed = true;
+          break;
+        }
+      }
+    }
+  } while ($changed);
+
+  return $preserving;
+}
+
+/*
+ * Returns the set (name => true) of functions that can call themselves, directly or
+ * through other functions. Only the 'calls' of each function in $graph are used.
+ */
+function recursiveFunctions(array $graph): array {
+  $recursive = [];
+  foreach ($graph as $name => $_) {
+    $seen = [];
+    $worklist = [$name];
+    while (count($worklist) > 0) {
+      foreach ($graph[array_pop($worklist)]['calls'] as $callee => $_) {
+        if (!array_key_exists($callee, $graph) || array_key_exists($callee, $seen))
+          continue;
+        if ($callee === $name) {
+          $recursive[$name] = true;
+          break 2;
+        }
+        $seen[$callee] = true;
+        $worklist[] = $callee;
+      }
+    }
+  }
+
+  return $recursive;
+}
+
+/*
+ * Returns the number of variables the Hack assembler allocates for the program: its
+ * static variables (the highest index of each file's 'static' segment, plus one, summed
+ * over the files), counting the ones that only the symbols of a RAM image, e.g. 'Main.3',
+ * store, and one for every other symbol of the image.
+ */
+function countStatics(array $sources, array $imageSymbols): int {
+  $sizes = []; # file => highest static index + 1
+  foreach ($sources as $file => $source) {
+    if (preg_match_all('/^\s*(?:push|pop)\s+static\s+(\d+)/m', $source, $matches))
+      $sizes[$file] = max(array_map('intval', $matches[1])) + 1;
+  }
+
+  $others = 0;
+  foreach ($imageSymbols as $symbol) {
+    if (is_int($symbol)) # an address
+      continue;
+    if (preg_match('/^(.*)\.(\d+)$/', $symbol, $match) && array_key_exists($match[1], $sources)) {
+      $size = array_key_exists($match[1], $sizes)? $sizes[$match[1]] : 0;
+      $sizes[$match[1]] = max($size, intval($match[2]) + 1);
+    } else {
+      $others++;
+    }
+  }
+
+  return array_sum($sizes) + $others;
+}
+
+/*
+ * Gives the locals of non-recursive functions, and the arguments they use more than
+ * once, fixed RAM slots from address $base on, so that accessing them does not go
+ * through LCL or ARG. A non-recursive function has at most one activation at any
+ * time, so its slots only
+ * need to differ from those of the functions that can be active at the same time -
+ * the ones that can reach it in the call graph and the ones it can reach. Other
+ * functions share slots. Functions are left on the Stack when the $budget words of
+ * slots run out.
+ *
+ * Return Value:
+ * function name => ['locals' => [local index => slot], 'args' => [argument index => slot]],
+ * where a slot is a RAM address.
+ */
+function allocateFrameSlots(array $graph, int $budget, int $base): array {
+  $recursive = recursiveFunctions($graph);
+
+  $callers = [];
+  foreach ($graph as $name => $function) {
+    foreach ($function['calls'] as $callee => $_)
+      $callers[$callee][$name] = true;
+  }
+
+  $candidates = [];
+  foreach ($graph as $name => $function) {
+    if (array_key_exists($name, $recursive))
+      continue;
+    $args = [];
+    foreach ($function['argUses'] as $index => $uses) {
+      if ($uses > 1)
+        $args[] = $index;
+    }
+    sort($args);
+    if ($function['locals'] + count($args) === 0)
+      continue;
+
+    # every function that can be active while this one is
+    $ancestors = [];
+    $worklist = [$name];
+    while (count($worklist) > 0) {
+      $current = array_pop($worklist);
+      if (!array_key_exists($current, $callers))
+        continue;
+      foreach ($callers[$current] as $caller => $_) {
+        if (!array_key_exists($caller, $ancestors)) {
+          $ancestors[$caller] = true;
+          $worklist[] = $caller;
+        }
+      }
+    }
+    $candidates[$name] = ['args' => $args, 'ancestors' => $ancestors];
+  }
+
+  # An allocated ancestor always has fewer ancestors than its descendants, so this
+  # order allocates every function after the functions above it.
+  uasort($candidates, function($a, $b) { return count($a['ancestors']) - count($b['ancestors']); });
+
+  $ends = [];
+  $slots = [];
+  foreach ($candidates as $name => $candidate) {
+    $offset = 0;
+    foreach ($candidate['ancestors'] as $ancestor => $_) {
+      if (array_key_exists($ancestor, $ends))
+        $offset = max($offset, $ends[$ancestor]);
+    }
+    $numLocals = $graph[$name]['locals'];
+    if ($offset + $numLocals + count($candidate['args']) > $budget)
+      continue;
+
+    $slots[$name] = ['locals' => [], 'args' => []];
+    for ($i = 0; $i < $numLocals; $i++)
+      $slots[$name]['locals'][$i] = $base + $offset + $i;
+    foreach ($candidate['args'] as $k => $index)
+      $slots[$name]['args'][$index] = $base + $offset + $numLocals + $k;
+    $ends[$name] = $offset + $numLocals + count($candidate['args']);
+  }
+
+  return $slots;
+}
+
+/*
+ * Returns a string describing the facts the translation of $file depends on: which of
+ * its functions, and of the functions they call, are in the set $facts. Used in the
+ * cache key of the file's fragment.
+ */
+function factsKey(array $graph, array $facts, string $file): string {
+  $names = [];
+  foreach ($graph as $name => $function) {
+    if ($function['file'] !== $file)
+      continue;
+    $names[$name] = true;
+    foreach ($function['calls'] as $callee => $_)
+      $names[$callee] = true;
+  }
+  ksort($names);
+
+  $key = '';
+  foreach ($names as $name => $_)
+    $key .= $name.(array_key_exists($name, $facts)? '+' : '-').' ';
+
+  return $key;
+}
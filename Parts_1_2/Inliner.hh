@@ -0,0 +1,371 @@
+<?hh
+
+// Inlining of small functions across the whole VM program
+
+/*
+ * The VM program is handled as file name => [
+ *   'header' => commands before the file's first 'function' command,
+ *   'functions' => [['name' => 'Class.func', 'locals' => n, 'body' => commands], ...]
+ * ]
+ * where every command is an array of its words, e.g. ['push', 'local', '2'].
+ */
+
+# Functions of up to this many VM commands are inlined (--inline-limit=N, e.g. 8). 0 turns inlining off.
+const DEFAULT_INLINE_LIMIT = 0;
+
+/*
+ * Parses the sources of the VM files (file name => source) into a VM program.
+ */
+function parseVmProgram(array $sources): array {
+  $program = [];
+  foreach ($sources as $file => $source) {
+    $unit = ['header' => [], 'functions' => []];
+    $current = -1; # index of the function being parsed
+    foreach (explode("\n", $source) as $line) {
+      if (($pos = strpos($line, '//')) !== false) # drop comments
+        $line = substr($line, 0, $pos);
+      $line = trim($line);
+      if ($line === '')
+        continue;
+
+      $command = preg_split('/\s+/', $line);
+      if ($command[0] === 'function') {
+        $unit['functions'][] = ['name' => $command[1], 'locals' => intval($command[2]), 'body' => []];
+        $current = count($unit['functions']) - 1;
+      } else if ($current < 0) {
+        $unit['header'][] = $command;
+      } else {
+        $unit['functions'][$current]['body'][] = $command;
+      }
+    }
+    $program[$file] = $unit;
+  }
+
+  return $program;
+}
+
+/*
+ * The inverse of parseVmProgram: returns file name => VM source.
+ */
+function vmProgramSources(array $program): array {
+  $sources = [];
+  foreach ($program as $file => $unit) {
+    $source = '';
+    foreach ($unit['header'] as $command)
+      $source .= implode(' ', $command)."\n";
+    foreach ($unit['functions'] as $function) {
+      $source .= 'function '.$function['name'].' '.$function['locals']."\n";
+      foreach ($function['body'] as $command)
+        $source .= implode(' ', $command)."\n";
+    }
+    $sources[$file] = $source;
+  }
+
+  return $sources;
+}
+
+/*
+ * Replaces calls to small, non-recursive functions by their bodies. Callees are
+ * processed before their callers, so calls inside an inlined body may already have
+ * been inlined themselves.
+ *
+ * At a call site the arguments are popped into fresh locals of the caller, the
+ * callee's locals get fresh (zeroed) locals too, 'argument' and 'local' accesses in
+ * the body are remapped to them, its labels are renamed, and its returns become
+ * jumps past the body. If the body changes THIS or THAT and the caller depends on
+ * them, they are saved in another fresh local and restored afterwards. Fresh locals
+ * are reused between call sites.
+ */
+function inlineSmallFunctions(array $program, int $sizeLimit): array {
+  $where = []; # function name => [file, index]
+  foreach ($program as $file => $unit) {
+    foreach ($unit['functions'] as $i => $function)
+      $where[$function['name']] = [$file, $i];
+  }
+
+  $order = [];
+  $visited = [];
+  foreach ($where as $name => $_)
+    postOrderVisit($name, $program, $where, $visited, $order);
+
+  $graph = [];
+  foreach ($where as $name => $location) {
+    $graph[$name] = ['calls' => []];
+    foreach ($program[$location[0]]['functions'][$location[1]]['body'] as $command) {
+      if ($command[0] === 'call')
+        $graph[$name]['calls'][$command[1]] = intval($command[2]);
+    }
+  }
+  $recursive = recursiveFunctions($graph);
+  $observers = pointerObservers($program, $where);
+  $counter = 0; # makes renamed labels unique
+  foreach ($order as $name) {
+    list($file, $i) = $where[$name];
+    $program[$file]['functions'][$i] = inlineCallsIn($program[$file]['functions'][$i], $file, $program, $where,
+      $recursive, $observers, $sizeLimit, $counter);
+  }
+
+  return $program;
+}
+
+# Appends the functions reachable from $name to $order, callees first.
+function postOrderVisit(string $name, array $program, array $where, array &$visited, array &$order): void {
+  if (array_key_exists($name, $visited))
+    return;
+  $visited[$name] = true;
+  list($file, $i) = $where[$name];
+  foreach ($program[$file]['functions'][$i]['body'] as $command) {
+    if ($command[0] === 'call' && array_key_exists($command[1], $where))
+      postOrderVisit($command[1], $program, $where, $visited, $order);
+  }
+  $order[] = $name;
+}
+
+/*
+ * Inlines every eligible call in $caller's body and returns the updated function.
+ */
+function inlineCallsIn(array $caller, string $callerFile, array $program, array $where, array $recursive,
+                       array $observers, int $sizeLimit, int &$counter): array {
+  # the pointers the caller depends on: it reads them, or a function it calls may read them before setting them
+  $dependsOn = [false, false];
+  foreach ($caller['body'] as $command) {
+    for ($p = 0; $p < 2; $p++) {
+      if (readsPointer($command, $p) || ($command[0] === 'call' && array_key_exists($command[1], $observers[$p])))
+        $dependsOn[$p] = true;
+    }
+  }
+
+  $body = [];
+  $locals = $caller['locals'];
+  foreach ($caller['body'] as $command) {
+    if ($command[0] === 'call' && array_key_exists($command[1], $where) && !array_key_exists($command[1], $recursive)) {
+      list($file, $i) = $where[$command[1]];
+      $expansion = inlineExpansion($program[$file]['functions'][$i], intval($command[2]), $caller['locals'],
+        $file === $callerFile, $dependsOn, $sizeLimit, $counter);
+      if ($expansion !== null) {
+        foreach ($expansion['body'] as $inlined)
+          $body[] = $inlined;
+        $locals = max($locals, $expansion['locals']);
+        continue;
+      }
+    }
+    $body[] = $command;
+  }
+
+  $caller['body'] = $body;
+  $caller['locals'] = $locals;
+
+  return $caller;
+}
+
+/*
+ * Returns the commands replacing a call to $callee, and the number of locals the caller
+ * needs for them, or null if the callee cannot be inlined here. The fresh locals start
+ * at local $base.
+ */
+function inlineExpansion(array $callee, int $numArgs, int $base, bool $sameFile, array $dependsOn,
+                         int $sizeLimit, int &$counter): ?array {
+  if (count($callee['body']) > $sizeLimit || !returnsBalanced($callee['body']))
+    return null;
+
+  $numLocals = $callee['locals'];
+  $localBase = $base + $numArgs;
+  $saveBase = $localBase + $numLocals;
+  $tag = ':inline'.$counter;
+  $last = count($callee['body']) - 1;
+
+  $inlined = [];
+  $writes = [false, false];
+  $needsEnd = false;
+  foreach ($callee['body'] as $j => $command) {
+    switch ($command[0]) {
+      case 'push':
+      case 'pop':
+        $index = intval($command[2]);
+        if ($command[1] === 'argument') {
+          if ($index >= $numArgs)
+            return null;
+          $command = [$command[0], 'local', strval($base + $index)];
+        } else if ($command[1] === 'local') {
+          $command = [$command[0], 'local', strval($localBase + $index)];
+        } else if ($command[1] === 'static' && !$sameFile) {
+          return null; # statics are named after the file that uses them
+        } else if ($command[1] === 'pointer' && $command[0] === 'pop') {
+          $writes[$index] = true;
+        }
+        break;
+      case 'label':
+      case 'goto':
+      case 'if-goto':
+        $command = [$command[0], $command[1].$tag];
+        break;
+      case 'return':
+        if ($j === $last) # the return value is already on top of the stack
+          continue 2;
+        $command = ['goto', 'INLINE_END'.$tag];
+        $needsEnd = true;
+        break;
+    }
+    $inlined[] = $command;
+  }
+
+  $saves = [];
+  for ($p = 0; $p < 2; $p++) {
+    if ($writes[$p] && $dependsOn[$p])
+      $saves[] = $p;
+  }
+
+  $retBody = [];
+  for ($k = $numArgs - 1; $k >= 0; $k--) # the last argument is on top of the stack
+    $retBody[] = ['pop', 'local', strval($base + $k)];
+  foreach ($saves as $n => $p) {
+    $retBody[] = ['push', 'pointer', strval($p)];
+    $retBody[] = ['pop', 'local', strval($saveBase + $n)];
+  }
+  for ($k = 0; $k < $numLocals; $k++) {
+    $retBody[] = ['push', 'constant', '0'];
+    $retBody[] = ['pop', 'local', strval($localBase + $k)];
+  }
+  foreach ($inlined as $command)
+    $retBody[] = $command;
+  if ($needsEnd)
+    $retBody[] = ['label', 'INLINE_END'.$tag];
+  foreach ($saves as $n => $p) {
+    $retBody[] = ['push', 'local', strval($saveBase + $n)];
+    $retBody[] = ['pop', 'pointer', strval($p)];
+  }
+  $counter++;
+
+  return ['body' => $retBody, 'locals' => $saveBase + count($saves)];
+}
+
+# Whether the command uses the value of THIS ($p = 0) or THAT ($p = 1).
+function readsPointer(array $command, int $p): bool {
+  if ($command[0] !== 'push' && $command[0] !== 'pop')
+    return false;
+  if ($command[1] === (($p === 0)? 'this' : 'that'))
+    return true;
+  return $command[0] === 'push' && $command[1] === 'pointer' && intval($command[2]) === $p;
+}
+
+/*
+ * Returns, for THIS ($p = 0) and THAT ($p = 1), the set (name => true) of functions
+ * that may use the pointer they were called with: directly (see observesIncomingPointer),
+ * or through a function they call before setting it, however deep. Functions outside
+ * the program are assumed to use both.
+ */
+function pointerObservers(array $program, array $where): array {
+  $observers = [[], []];
+  $calledFirst = [[], []]; # the functions each function may call before setting the pointer
+  foreach ($where as $name => $location) {
+    $body = $program[$location[0]]['functions'][$location[1]]['body'];
+    for ($p = 0; $p < 2; $p++) {
+      $calledFirst[$p][$name] = [];
+      if (observesIncomingPointer($body, $p, $calledFirst[$p][$name]))
+        $observers[$p][$name] = true;
+    }
+  }
+
+  # a function observes a pointer if it calls an observer before setting it, until nothing changes
+  for ($p = 0; $p < 2; $p++) {
+    do {
+      $changed = false;
+      foreach ($calledFirst[$p] as $name => $callees) {
+        if (array_key_exists($name, $observers[$p]))
+          continue;
+        foreach ($callees as $callee => $_) {
+          if (!array_key_exists($callee, $where) || array_key_exists($callee, $observers[$p])) {
+            $observers[$p][$name] = true;
+            $changed = true;
+            break;
+          }
+        }
+      }
+    } while ($changed);
+  }
+
+  return $observers;
+}
+
+/*
+ * Whether a body may use the THIS ($p = 0) or THAT ($p = 1) it was called with: some use
+ * of the pointer is not preceded by a 'pop pointer' in the same straight-line stretch
+ * of code. The functions it calls where the pointer may still be the incoming one are
+ * added to $calls.
+ */
+function observesIncomingPointer(array $body, int $p, array &$calls): bool {
+  $set = false;
+  foreach ($body as $command) {
+    if ($command[0] === 'label')
+      $set = false; # control may arrive here from anywhere
+    else if ($command[0] === 'pop' && $command[1] === 'pointer' && intval($command[2]) === $p)
+      $set = true;
+    else if (!$set && readsPointer($command, $p))
+      return true;
+    else if (!$set && $command[0] === 'call')
+      $calls[$command[1]] = true;
+  }
+
+  return false;
+}
+
+/*
+ * Whether every 'return' of a body is reached with exactly the return value on the
+ * body's part of the stack, and the body never pops below it. Only such bodies can
+ * be inlined without a frame of their own.
+ */
+function returnsBalanced(array $body): bool {
+  $effects = ['push' => 1, 'pop' => -1, 'add' => -1, 'sub' => -1, 'and' => -1, 'or' => -1,
+              'eq' => -1, 'gt' => -1, 'lt' => -1, 'neg' => 0, 'not' => 0];
+  $depth = 0; # null after an unconditional jump
+  $labelDepths = [];
+  foreach ($body as $command) {
+    $op = $command[0];
+    if ($op === 'label') {
+      $label = $command[1];
+      if (array_key_exists($label, $labelDepths)) {
+        if ($depth !== null && $depth !== $labelDepths[$label])
+          return false;
+        $depth = $labelDepths[$label];
+      } else {
+        if ($depth === null) # only reachable from below, the depth there is unknown
+          return false;
+        $labelDepths[$label] = $depth;
+      }
+      continue;
+    }
+    if ($depth === null) # unreachable
+      continue;
+
+    switch ($op) {
+      case 'goto':
+      case 'if-goto':
+        if ($op === 'if-goto')
+          $depth--;
+        if ($depth < 0 || (array_key_exists($command[1], $labelDepths) && $labelDepths[$command[1]] !== $depth))
+          return false;
+        $labelDepths[$command[1]] = $depth;
+        if ($op === 'goto')
+          $depth = null;
+        break;
+      case 'return':
+        if ($depth !== 1)
+          return false;
+        $depth = null;
+        break;
+      case 'call':
+        if ($depth - intval($command[2]) < 0)
+          return false;
+        $depth += 1 - intval($command[2]);
+        break;
+      default:
+        if (!array_key_exists($op, $effects))
+          return false;
+        $depth += $effects[$op];
+        if ($depth < 0)
+          return false;
+    }
+  }
+
+  return $depth === null;
+}
@@ -0,0 +1,98 @@
+<?hh
+
+// Links the Hack fragments of separately translated VM files into one program
+
+/*
+ * A fragment is what translateFile() in Assembler.hh produces for one VM file:
+ *
+ *   [
+ *     'file' => the file name used for statics and generated labels,
+ *     'header' => Hack code that came before the file's first 'function' command,
+ *     'functions' => [
+ *       ['name' => 'Class.func', 'calls' => ['Other.func' => true, ...], 'code' => Hack code],
+ *       ...
+ *     ]
+ *   ]
+ *
+ * All labels generated inside a fragment are local to it, so fragments can be
+ * cached and linked in any combination. The only symbols shared between
+ * fragments are function names.
+ */
+
+# The function the bootstrap code jumps to
+$EntryFunction = 'Sys.init';
+
+/*
+ * Links the fragments and returns the Hack code of the whole program (without
+ * the bootstrap). Function symbols are resolved across fragments, then the
+ * whole-program passes are applied. Throws a "Link Error" if a function is
+ * defined more than once or a called function is not defined.
+ */
+function linkProgram(array $fragments, bool $removeDeadCode): string {
+  $functions = resolveSymbols($fragments);
+
+  if ($removeDeadCode)
+    $functions = removeUnreachableFunctions($functions, $GLOBALS['EntryFunction']);
+
+  $retString = '';
+  foreach ($fragments as $fragment) {
+    $retString .= $fragment['header'];
+    foreach ($fragment['functions'] as $function) {
+      if (array_key_exists($function['name'], $functions))
+        $retString .= $function['code'];
+    }
+  }
+
+  return $retString;
+}
+
+/*
+ * Builds the program's function table (name => function) and checks that every
+ * function is defined once and every called function is defined somewhere.
+ */
+function resolveSymbols(array $fragments): array {
+  $functions = [];
+  foreach ($fragments as $fragment) {
+    foreach ($fragment['functions'] as $function) {
+      if (array_key_exists($function['name'], $functions))
+        throw new Exception("Link Error: function ".$function['name']." is defined more than once (in ".$fragment['file'].")");
+      $functions[$function['name']] = $function;
+    }
+  }
+
+  foreach ($functions as $name => $function) {
+    foreach ($function['calls'] as $callee => $_) {
+      if (!array_key_exists($callee, $functions))
+        throw new Exception("Link Error: $name calls undefined function $callee");
+    }
+  }
+
+  return $functions;
+}
+
+/*
+ * Whole-program pass: keeps only the functions reachable from $entry through calls.
+ * If the program does not define $entry (e.g. a test without Sys.init), nothing is removed.
+ */
+function removeUnreachableFunctions(array $functions, string $entry): array {
+  if (!array_key_exists($entry, $functions))
+    return $functions;
+
+  $reachable = [$entry => $functions[$entry]];
+  $worklist = [$entry];
+  while (count($worklist) > 0) {
+    $name = array_pop($worklist);
+    foreach ($functions[$name]['calls'] as $callee => $_) {
+      if (array_key_exists($callee, $functions) && !array_key_exists($callee, $reachable)) {
+        $reachable[$callee] = $functions[$callee];
+        $worklist[] = $callee;
+      }
+    }
+  }
+
+  $removed = count($functions) - count($reachable);
+  if ($removed > 0)
+    echo "\nRemoved $removed unreachable function(s)\n";
+
+  return $reachable;
+}
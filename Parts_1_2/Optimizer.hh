@@ -0,0 +1,675 @@
+<?hh
+
+// A dataflow optimizer for the functions of a VM program
+
+/*
+ * Each function of the VM program (see parseVmProgram in Inliner.hh) is split into basic
+ * blocks, and every block is lifted from stack commands into statements over expression
+ * trees by running it on a symbolic stack. The nodes of a block are kept in a table
+ * (node id => node):
+ *
+ *   ['const', value]            a 16-bit value
+ *   ['load', segment, index]    the value of 'push segment index'
+ *   ['op', command, [ids]]      an arithmetic or logical command applied to its operands
+ *   ['call', name, [ids]]       a call and its arguments
+ *   ['in']                      a value that is already on the Stack when it is used
+ *   ['cse', slot, id]           (after eliminateCommonSubexpressions) node id, also kept in 'temp slot'
+ *
+ * and its statements are ['push', id], ['pop', segment, index, id], ['drop', id],
+ * ['if-goto', label, id], ['goto', label], ['label', label] and ['return', id]. 'drop'
+ * pops a value that is not needed; it is only used between the optimizer and the
+ * translator.
+ *
+ * Lowering a block emits every statement's tree in post-order, which is the order of the
+ * original commands, so values are computed and side effects happen in the same order as
+ * before the optimizations. The result is VM code again, translated as usual.
+ *
+ * The optimizations assume what Part_5/Compiler.hh guarantees: values are not passed
+ * between functions in the 'temp' segment, and array writes never reach the Stack.
+ * Code that may break them, e.g. hand-written VM, is checked for and left alone: if a
+ * function can read a temp that it did not write since it was entered or since its
+ * last call (see readsOuterTemps), no function that writes temps is optimized and no
+ * temps are used for common subexpressions; and a function that points THIS or THAT
+ * at a constant address below the heap is not optimized.
+ */
+
+# Variables whose known values are propagated within a block
+const PROPAGATED_SEGMENTS = ['local' => true, 'argument' => true, 'temp' => true, 'static' => true];
+
+# Variables that dead stores are removed from: they are private to a function's activation
+const TRACKED_SEGMENTS = ['local' => true, 'argument' => true, 'temp' => true];
+
+const UNARY_COMMANDS = ['neg' => true, 'not' => true];
+const BINARY_COMMANDS = ['add' => true, 'sub' => true, 'and' => true, 'or' => true, 'eq' => true, 'gt' => true,
+                         'lt' => true];
+
+/*
+ * Optimizes every function of the program and returns the updated program.
+ */
+function optimizeProgram(array $program): array {
+  $sharedTemps = false;
+  foreach ($program as $unit) {
+    foreach ($unit['functions'] as $function)
+      $sharedTemps = $sharedTemps || readsOuterTemps($function['body']);
+  }
+
+  foreach ($program as $file => $unit) {
+    foreach ($unit['functions'] as $i => $function)
+      $program[$file]['functions'][$i]['body'] = optimizeFunction($function['body'], $sharedTemps);
+  }
+
+  return $program;
+}
+
+/*
+ * Whether a body may read a temp that it did not write since it was entered or since
+ * its last call, i.e. one written by another function. Control may arrive at a label
+ * from anywhere, so a label forgets what was written.
+ */
+function readsOuterTemps(array $body): bool {
+  $written = [];
+  foreach ($body as $command) {
+    if ($command[0] === 'label' || $command[0] === 'call')
+      $written = [];
+    else if ($command[0] === 'pop' && $command[1] === 'temp')
+      $written[$command[2]] = true;
+    else if ($command[0] === 'push' && $command[1] === 'temp' && !array_key_exists($command[2], $written))
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Returns the optimized commands of a function body. Bodies with commands or jumps the
+ * optimizer does not understand, or that may break its assumptions (see the top of
+ * this file), are returned unchanged. $sharedTemps tells whether some function of the
+ * program reads temps that other functions wrote.
+ */
+function optimizeFunction(array $body, bool $sharedTemps): array {
+  $blocks = splitBlocks($body);
+  if ($blocks === null)
+    return $body;
+  $writesTemps = false;
+  foreach ($body as $command)
+    $writesTemps = $writesTemps || ($command[0] === 'pop' && $command[1] === 'temp');
+  if ($sharedTemps && $writesTemps)
+    return $body;
+
+  $lifted = [];
+  foreach ($blocks as $block) {
+    $ir = liftBlock($block['commands']);
+    if ($ir === null)
+      return $body;
+    propagateCopies($ir);
+    if (setsLowPointer($ir))
+      return $body;
+    $lifted[] = $ir;
+  }
+  removeDeadStores($lifted, $blocks);
+
+  $freeSlots = [];
+  for ($slot = 7; $slot >= 1 && !$sharedTemps; $slot--)
+    $freeSlots[$slot] = true;
+  foreach ($body as $command) {
+    if (($command[0] === 'push' || $command[0] === 'pop') && $command[1] === 'temp')
+      unset($freeSlots[intval($command[2])]);
+  }
+
+  $optimized = [];
+  foreach ($lifted as $ir) {
+    eliminateCommonSubexpressions($ir, array_keys($freeSlots));
+    foreach (lowerBlock($ir) as $command)
+      $optimized[] = $command;
+  }
+
+  return $optimized;
+}
+
+# Whether a block points THIS or THAT at a constant address below the heap, e.g. into the Stack.
+function setsLowPointer(array $ir): bool {
+  foreach ($ir['statements'] as $statement) {
+    if ($statement[0] !== 'pop' || $statement[1] !== 'pointer')
+      continue;
+    $node = $ir['nodes'][$statement[3]];
+    if ($node[0] === 'const' && ($node[1] & 0xFFFF) < HEAP_BASE)
+      return true;
+  }
+
+  return false;
+}
+
+/*
+ * Splits a body into basic blocks: ['commands' => [...], 'succ' => [block index, ...]].
+ * A block starts at a label or after a jump or return. Returns null if a jump targets a
+ * label the function does not define.
+ */
+function splitBlocks(array $body): ?array {
+  $blocks = [];
+  $current = [];
+  foreach ($body as $command) {
+    if ($command[0] === 'label' && count($current) > 0) {
+      $blocks[] = $current;
+      $current = [];
+    }
+    $current[] = $command;
+    if ($command[0] === 'goto' || $command[0] === 'if-goto' || $command[0] === 'return') {
+      $blocks[] = $current;
+      $current = [];
+    }
+  }
+  if (count($current) > 0)
+    $blocks[] = $current;
+
+  $labels = [];
+  foreach ($blocks as $b => $commands) {
+    if ($commands[0][0] === 'label')
+      $labels[$commands[0][1]] = $b;
+  }
+
+  $result = [];
+  foreach ($blocks as $b => $commands) {
+    $last = $commands[count($commands) - 1];
+    $succ = [];
+    if ($last[0] === 'goto' || $last[0] === 'if-goto') {
+      if (!array_key_exists($last[1], $labels))
+        return null;
+      $succ[] = $labels[$last[1]];
+    }
+    if ($last[0] !== 'goto' && $last[0] !== 'return' && $b + 1 < count($blocks))
+      $succ[] = $b + 1;
+    $result[] = ['commands' => $commands, 'succ' => $succ];
+  }
+
+  return $result;
+}
+
+/*
+ * Lifts the commands of a block into ['nodes' => node table, 'statements' => [...]], or
+ * returns null for an unknown command. Values left on the Stack by the previous block
+ * become 'in' nodes. Before a statement consumes the top of the symbolic stack, the
+ * values below it are emitted as 'push' statements (they were computed earlier), so the
+ * statements keep the original order of evaluation.
+ */
+function liftBlock(array $commands): ?array {
+  $nodes = [];
+  $statements = [];
+  $stack = [];
+  foreach ($commands as $command) {
+    $op = $command[0];
+    switch ($op) {
+      case 'push':
+        $nodes[] = ($command[1] === 'constant')? ['const', toWord(intval($command[2]))]
+          : ['load', $command[1], intval($command[2])];
+        $stack[] = count($nodes) - 1;
+        break;
+      case 'pop':
+        $id = liftPop($stack, $nodes);
+        liftFlush($stack, $nodes, $statements);
+        $statements[] = ['pop', $command[1], intval($command[2]), $id];
+        break;
+      case 'call':
+        $args = [];
+        for ($k = intval($command[2]); $k > 0; $k--)
+          array_unshift($args, liftPop($stack, $nodes));
+        $nodes[] = ['call', $command[1], $args];
+        $stack[] = count($nodes) - 1;
+        break;
+      case 'if-goto':
+      case 'return':
+      case 'drop':
+        $id = liftPop($stack, $nodes);
+        liftFlush($stack, $nodes, $statements);
+        $statements[] = ($op === 'if-goto')? [$op, $command[1], $id] : [$op, $id];
+        break;
+      case 'goto':
+        liftFlush($stack, $nodes, $statements);
+        $statements[] = ['goto', $command[1]];
+        break;
+      case 'label':
+        $statements[] = ['label', $command[1]];
+        break;
+      default:
+        if (array_key_exists($op, UNARY_COMMANDS)) {
+          $operands = [liftPop($stack, $nodes)];
+        } else if (array_key_exists($op, BINARY_COMMANDS)) {
+          $y = liftPop($stack, $nodes);
+          $operands = [liftPop($stack, $nodes), $y];
+        } else {
+          return null;
+        }
+        $nodes[] = ['op', $op, $operands];
+        $stack[] = count($nodes) - 1;
+    }
+  }
+  liftFlush($stack, $nodes, $statements);
+
+  return ['nodes' => $nodes, 'statements' => $statements];
+}
+
+# Pops the symbolic stack. Below its bottom are the values the previous block left.
+function liftPop(array &$stack, array &$nodes): int {
+  if (count($stack) > 0)
+    return array_pop($stack);
+  $nodes[] = ['in'];
+  return count($nodes) - 1;
+}
+
+# Emits the values on the symbolic stack as 'push' statements, leaving 'in' nodes in their place.
+function liftFlush(array &$stack, array &$nodes, array &$statements): void {
+  foreach ($stack as $k => $id) {
+    if ($nodes[$id][0] === 'in')
+      continue;
+    $statements[] = ['push', $id];
+    $nodes[] = ['in'];
+    $stack[$k] = count($nodes) - 1;
+  }
+}
+
+/*
+ * Copy and constant propagation with constant folding, within a block. After 'pop x' of
+ * a constant, or of a local or argument y, later reads of x use the constant or y
+ * directly until x or y changes. Conditional jumps on a constant become a 'goto' or
+ * disappear.
+ */
+function propagateCopies(array &$ir): void {
+  $known = []; # 'segment index' => id of the node (a constant, or a load of a local or argument) it equals
+  $statements = [];
+  foreach ($ir['statements'] as $statement) {
+    $root = statementRoot($statement);
+    if ($root >= 0)
+      substitute($ir['nodes'], $root, $known);
+
+    switch ($statement[0]) {
+      case 'pop':
+        $key = $statement[1].' '.$statement[2];
+        forgetVariable($known, $ir['nodes'], $key);
+        if ($statement[1] === 'this' || $statement[1] === 'that')
+          forgetSegments($known, ['static' => true, 'temp' => true]); # the array write may reach them
+        $node = $ir['nodes'][$root];
+        if (array_key_exists($statement[1], PROPAGATED_SEGMENTS) && ($node[0] === 'const'
+            || ($node[0] === 'load' && ($node[1] === 'local' || $node[1] === 'argument') && $node[1].' '.$node[2] !== $key)))
+          $known[$key] = $root;
+        break;
+      case 'if-goto':
+        $node = $ir['nodes'][$root];
+        if ($node[0] === 'const') {
+          if ($node[1] === 0)
+            continue 2; # never taken
+          $statement = ['goto', $statement[1]];
+        }
+        break;
+    }
+    $statements[] = $statement;
+  }
+
+  $ir['statements'] = $statements;
+}
+
+# Replaces the known variables read by a tree, in evaluation order, and folds constants.
+function substitute(array &$nodes, int $id, array &$known): void {
+  $node = $nodes[$id];
+  if ($node[0] === 'op' || $node[0] === 'call') {
+    foreach ($node[2] as $child)
+      substitute($nodes, $child, $known);
+  }
+
+  switch ($node[0]) {
+    case 'load':
+      $key = $node[1].' '.$node[2];
+      if (array_key_exists($key, $known))
+        $nodes[$id] = $nodes[$known[$key]];
+      break;
+    case 'op':
+      $values = [];
+      foreach ($node[2] as $child) {
+        if ($nodes[$child][0] !== 'const')
+          return;
+        $values[] = $nodes[$child][1];
+      }
+      $nodes[$id] = ['const', foldConstant($node[1], $values)];
+      break;
+    case 'call':
+      forgetSegments($known, ['static' => true, 'temp' => true]); # the callee may change them
+      break;
+  }
+}
+
+# Evaluates a command on constants as the Hack code does: comparisons test the sign of x - y.
+function foldConstant(string $command, array $values): int {
+  if (count($values) === 1)
+    return toWord(($command === 'neg')? -$values[0] : ~$values[0]);
+
+  list($x, $y) = $values;
+  $difference = toWord($x - $y);
+  switch ($command) {
+    case 'add': return toWord($x + $y);
+    case 'sub': return $difference;
+    case 'and': return $x & $y;
+    case 'or': return $x | $y;
+    case 'eq': return ($difference === 0)? -1 : 0;
+    case 'gt': return ($difference > 0)? -1 : 0;
+    default: return ($difference < 0)? -1 : 0; # lt
+  }
+}
+
+# A value as a signed 16-bit word.
+function toWord(int $value): int {
+  return (($value + 32768) & 0xFFFF) - 32768;
+}
+
+# Forgets what is known about a variable, and every variable known to be equal to it.
+function forgetVariable(array &$known, array $nodes, string $key): void {
+  unset($known[$key]);
+  foreach ($known as $other => $id) {
+    if ($nodes[$id][0] === 'load' && $nodes[$id][1].' '.$nodes[$id][2] === $key)
+      unset($known[$other]);
+  }
+}
+
+function forgetSegments(array &$known, array $segments): void {
+  foreach ($known as $key => $_) {
+    if (array_key_exists(explode(' ', $key)[0], $segments))
+      unset($known[$key]);
+  }
+}
+
+# The root of the tree a statement evaluates, or -1.
+function statementRoot(array $statement): int {
+  switch ($statement[0]) {
+    case 'push':
+    case 'drop':
+    case 'return':
+      return $statement[1];
+    case 'pop':
+      return $statement[3];
+    case 'if-goto':
+      return $statement[2];
+    default:
+      return -1;
+  }
+}
+
+/*
+ * Removes stores to locals, arguments and temps that are not read before they are
+ * overwritten or the function returns, using liveness over the control flow graph. A
+ * dead store of a value without side effects is removed with the value; otherwise the
+ * value is still computed and dropped (e.g. the result of a 'do' call).
+ */
+function removeDeadStores(array &$lifted, array $blocks): void {
+  # the variables each block reads before writing them, and the ones it writes
+  $uses = [];
+  $defs = [];
+  foreach ($lifted as $b => $ir) {
+    $uses[$b] = [];
+    $defs[$b] = [];
+    foreach ($ir['statements'] as $statement) {
+      $root = statementRoot($statement);
+      if ($root >= 0) {
+        foreach (treeReads($ir['nodes'], $root) as $key => $_) {
+          if (!array_key_exists($key, $defs[$b]))
+            $uses[$b][$key] = true;
+        }
+      }
+      $key = storedVariable($statement);
+      if ($key !== '')
+        $defs[$b][$key] = true;
+    }
+  }
+
+  # live-in = uses + (live-out - defs), until nothing changes; the sets only grow
+  $liveIn = array_fill(0, count($lifted), []);
+  do {
+    $changed = false;
+    for ($b = count($lifted) - 1; $b >= 0; $b--) {
+      $in = $uses[$b] + array_diff_key(liveOut($blocks[$b]['succ'], $liveIn), $defs[$b]);
+      if (count($in) !== count($liveIn[$b])) {
+        $liveIn[$b] = $in;
+        $changed = true;
+      }
+    }
+  } while ($changed);
+
+  foreach ($lifted as $b => $ir) {
+    $live = liveOut($blocks[$b]['succ'], $liveIn);
+    $statements = [];
+    for ($k = count($ir['statements']) - 1; $k >= 0; $k--) {
+      $statement = $ir['statements'][$k];
+      $key = storedVariable($statement);
+      if ($key !== '' && !array_key_exists($key, $live)) {
+        if (isPure($ir['nodes'], $statement[3]))
+          continue;
+        $statement = ['drop', $statement[3]];
+      } else if ($key !== '') {
+        unset($live[$key]);
+      }
+      $root = statementRoot($statement);
+      if ($root >= 0)
+        $live += treeReads($ir['nodes'], $root);
+      $statements[] = $statement;
+    }
+    $lifted[$b]['statements'] = array_reverse($statements);
+  }
+}
+
+function liveOut(array $succ, array $liveIn): array {
+  $out = [];
+  foreach ($succ as $s)
+    $out += $liveIn[$s];
+  return $out;
+}
+
+# The tracked variable ('segment index') a statement stores to, or ''.
+function storedVariable(array $statement): string {
+  if ($statement[0] !== 'pop' || !array_key_exists($statement[1], TRACKED_SEGMENTS))
+    return '';
+  return $statement[1].' '.$statement[2];
+}
+
+# The set of tracked variables a tree reads.
+function treeReads(array $nodes, int $id): array {
+  $node = $nodes[$id];
+  if ($node[0] === 'load')
+    return array_key_exists($node[1], TRACKED_SEGMENTS)? [$node[1].' '.$node[2] => true] : [];
+  $reads = [];
+  if ($node[0] === 'op' || $node[0] === 'call') {
+    foreach ($node[2] as $child)
+      $reads += treeReads($nodes, $child);
+  }
+  return $reads;
+}
+
+# Whether a tree can be dropped without evaluating it: no calls, and nothing from the Stack.
+function isPure(array $nodes, int $id): bool {
+  $node = $nodes[$id];
+  if ($node[0] === 'call' || $node[0] === 'in')
+    return false;
+  if ($node[0] === 'op') {
+    foreach ($node[2] as $child) {
+      if (!isPure($nodes, $child))
+        return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Common subexpression elimination within a block: a subtree computed again before any
+ * of the values it reads can change (e.g. 'push this 2' several times in an expression)
+ * is kept in a free temp slot the first time and pushed from there afterwards. Nothing
+ * is kept across a call. It is only done when it saves Hack instructions by the
+ * estimate of hackCost.
+ */
+function eliminateCommonSubexpressions(array &$ir, array $freeSlots): void {
+  if (count($freeSlots) === 0)
+    return;
+
+  $open = []; # subtree key => ids of its occurrences since the values it reads last changed
+  $groups = [];
+  foreach ($ir['statements'] as $statement) {
+    $root = statementRoot($statement);
+    if ($root >= 0)
+      collectSubtrees($ir['nodes'], $root, $open, $groups);
+    if ($statement[0] === 'pop') {
+      $segments = ($statement[1] === 'pointer' || $statement[1] === 'this' || $statement[1] === 'that')?
+        ['this', 'that', 'static', 'temp'] : [];
+      closeGroups($open, $groups, $statement[1].' '.$statement[2], $segments);
+    }
+  }
+  foreach ($open as $ids)
+    $groups[] = $ids;
+
+  # the largest subtrees first; their occurrences hide the subtrees inside them
+  usort($groups, function($a, $b) use ($ir) {
+    return subtreeSize($ir['nodes'], $b[0]) - subtreeSize($ir['nodes'], $a[0]);
+  });
+  $hidden = [];
+  foreach ($groups as $ids) {
+    $ids = array_values(array_filter($ids, function($id) use ($hidden) { return !array_key_exists($id, $hidden); }));
+    if (count($ids) < 2 || count($freeSlots) === 0)
+      continue;
+    # each reuse costs a push from the slot (6), keeping the value costs a pop and a push (11)
+    if ((count($ids) - 1) * (hackCost($ir['nodes'], $ids[0]) - 6) <= 11)
+      continue;
+
+    $slot = array_shift($freeSlots);
+    foreach ($ids as $id)
+      $hidden += subtreeIds($ir['nodes'], $id);
+    $ir['nodes'][] = $ir['nodes'][$ids[0]];
+    $ir['nodes'][$ids[0]] = ['cse', $slot, count($ir['nodes']) - 1];
+    for ($k = 1; $k < count($ids); $k++)
+      $ir['nodes'][$ids[$k]] = ['load', 'temp', $slot];
+  }
+}
+
+# Records the occurrences of the pure subtrees of a tree, in evaluation order. Returns its key, or ''.
+function collectSubtrees(array $nodes, int $id, array &$open, array &$groups): string {
+  $node = $nodes[$id];
+  switch ($node[0]) {
+    case 'load':
+      $key = 'load '.$node[1].' '.$node[2];
+      break;
+    case 'op':
+    case 'call':
+      $keys = [];
+      foreach ($node[2] as $child)
+        $keys[] = collectSubtrees($nodes, $child, $open, $groups);
+      if ($node[0] === 'call') {
+        foreach ($open as $ids) # the callee may change anything, and use the temp slots
+          $groups[] = $ids;
+        $open = [];
+        return '';
+      }
+      if (in_array('', $keys, true))
+        return '';
+      $key = $node[1].'('.implode(',', $keys).')';
+      break;
+    default:
+      return ''; # constants are cheap to push again, 'in' values are on the Stack only once
+  }
+  $open[$key][] = $id;
+  return $key;
+}
+
+# Ends the groups of the subtrees that read a changed variable, or any variable of $segments.
+function closeGroups(array &$open, array &$groups, string $variable, array $segments): void {
+  foreach ($open as $key => $ids) {
+    $reads = preg_match('/load '.preg_quote($variable, '/').'\b/', $key);
+    foreach ($segments as $segment)
+      $reads = $reads || strpos($key, "load $segment ") !== false;
+    if ($reads) {
+      $groups[] = $ids;
+      unset($open[$key]);
+    }
+  }
+}
+
+function subtreeSize(array $nodes, int $id): int {
+  return count(subtreeIds($nodes, $id));
+}
+
+# The set of ids of a tree's nodes.
+function subtreeIds(array $nodes, int $id): array {
+  $ids = [$id => true];
+  if ($nodes[$id][0] === 'op') {
+    foreach ($nodes[$id][2] as $child)
+      $ids += subtreeIds($nodes, $child);
+  }
+  return $ids;
+}
+
+# About how many Hack instructions computing and pushing a pure tree takes.
+function hackCost(array $nodes, int $id): int {
+  $node = $nodes[$id];
+  if ($node[0] === 'load') {
+    if ($node[1] === 'static' || $node[1] === 'temp' || $node[1] === 'pointer')
+      return 6;
+    return ($node[2] <= 2)? 7 + $node[2] : 9;
+  }
+  if ($node[0] === 'op') {
+    $cost = array_key_exists($node[1], UNARY_COMMANDS)? 9 : 13;
+    foreach ($node[2] as $child)
+      $cost += hackCost($nodes, $child);
+    return $cost;
+  }
+  return 6;
+}
+
+/*
+ * Lowers the statements of a block back to VM commands.
+ */
+function lowerBlock(array $ir): array {
+  $commands = [];
+  foreach ($ir['statements'] as $statement) {
+    $root = statementRoot($statement);
+    if ($root >= 0)
+      lowerNode($ir['nodes'], $root, $commands);
+    switch ($statement[0]) {
+      case 'pop':
+        $commands[] = ['pop', $statement[1], strval($statement[2])];
+        break;
+      case 'drop':
+      case 'return':
+        $commands[] = [$statement[0]];
+        break;
+      case 'if-goto':
+      case 'goto':
+      case 'label':
+        $commands[] = [$statement[0], $statement[1]];
+        break;
+    }
+  }
+
+  return $commands;
+}
+
+function lowerNode(array $nodes, int $id, array &$commands): void {
+  $node = $nodes[$id];
+  switch ($node[0]) {
+    case 'const':
+      if ($node[1] >= 0) {
+        $commands[] = ['push', 'constant', strval($node[1])];
+      } else if ($node[1] === -32768) {
+        $commands[] = ['push', 'constant', '32767'];
+        $commands[] = ['not'];
+      } else {
+        $commands[] = ['push', 'constant', strval(-$node[1])];
+        $commands[] = ['neg'];
+      }
+      break;
+    case 'load':
+      $commands[] = ['push', $node[1], strval($node[2])];
+      break;
+    case 'op':
+    case 'call':
+      foreach ($node[2] as $child)
+        lowerNode($nodes, $child, $commands);
+      $commands[] = ($node[0] === 'op')? [$node[1]] : ['call', $node[1], strval(count($node[2]))];
+      break;
+    case 'cse':
+      lowerNode($nodes, $node[2], $commands);
+      $commands[] = ['pop', 'temp', strval($node[1])];
+      $commands[] = ['push', 'temp', strval($node[1])];
+      break;
+  }
+}